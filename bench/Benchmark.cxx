@@ -0,0 +1,652 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+// Headless benchmark for the processing engine. Drives a SuperSeparator
+// instance through prepareToPlay & processBlock exactly as a host would, over
+// a matrix of block sizes, sample rates, precisions & parameter values, and
+// reports the cost of the processing callback.
+//
+// Alternatively, replays a session captured by the plugin's Recorder, with
+// the same input, block sizes & automation, and reports the cost of each
+// block - for reproducing a reported CPU spike under a profiler.
+//
+// Or, checks that output doesn't depend on how the host splits its input
+// into blocks: single samples, irregular sizes, and blocks far bigger than
+// promised in prepareToPlay should all match one offline pass over the whole
+// signal, which in turn should match a direct calculation where there is a
+// simple one.
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <JuceHeader.h>
+
+#include "CycleCounter.h"
+#include "Recorder.h"
+#include "SharedRegistry.h"
+#include "SuperSeparator.h"
+
+namespace
+{
+	struct Config
+	{
+		bool doublePrecision;
+		double sampleRate;
+		int blockSize;
+		int invert;
+		float delay;
+	};
+
+	struct Result
+	{
+		double nsPerSample;
+		double cyclesPerSample;
+		double megaSamplesPerSecond;
+	};
+
+	int constexpr blockSizes[] = {16, 64, 256, 1024, 4096, 8192};
+	double constexpr sampleRates[] = {44100, 48000, 96000, 192000, 384000};
+	// In ms; negative delays add latency
+	float constexpr delays[] = {0.0f, 0.02f, 1.0f, 15.0f, -15.0f};
+
+	template<typename SampleType>
+	Result run(SuperSeparator & proc, Config const & cfg, int totalSamples)
+	{
+		proc.setProcessingPrecision(cfg.doublePrecision
+				? juce::AudioProcessor::doublePrecision
+				: juce::AudioProcessor::singlePrecision);
+		proc.getParamDelay() = cfg.delay;
+		proc.getParamInvert() = cfg.invert;
+		proc.prepareToPlay(cfg.sampleRate, cfg.blockSize);
+
+		// Two main + two sidechain input channels; output shares the first
+		// two. Fill with noise so denormals & silence don't skew results.
+		juce::AudioBuffer<SampleType> buffer(4, cfg.blockSize);
+		juce::MidiBuffer midi;
+		juce::Random rng(0x5eed);
+
+		auto fill = [&]()
+		{
+			for (int c = 0; c < buffer.getNumChannels(); ++c)
+			{
+				SampleType * p = buffer.getWritePointer(c);
+				for (int i = 0; i < buffer.getNumSamples(); ++i)
+					p[i] = static_cast<SampleType>(rng.nextFloat() - 0.5f);
+			}
+		};
+
+		// Warm up caches & branch predictors
+		for (int i = 0; i < 16; ++i)
+		{
+			fill();
+			proc.processBlock(buffer, midi);
+		}
+
+		int const numBlocks = juce::jmax(1, totalSamples / cfg.blockSize);
+		uint64_t cycles = 0;
+		juce::int64 ticks = 0;
+		for (int i = 0; i < numBlocks; ++i)
+		{
+			// Refill outside the timed region, as processing is in-place
+			fill();
+
+			auto const t0 = juce::Time::getHighResolutionTicks();
+			auto const c0 = CycleCounter::now();
+			proc.processBlock(buffer, midi);
+			auto const c1 = CycleCounter::now();
+			auto const t1 = juce::Time::getHighResolutionTicks();
+
+			cycles += c1 - c0;
+			ticks += t1 - t0;
+		}
+
+		proc.releaseResources();
+
+		double const samples = static_cast<double>(numBlocks)
+			* cfg.blockSize;
+		double const seconds = juce::Time::highResolutionTicksToSeconds(
+				ticks);
+
+		Result r;
+		r.nsPerSample = seconds * 1e9 / samples;
+		r.cyclesPerSample = static_cast<double>(cycles) / samples;
+		r.megaSamplesPerSecond = samples / seconds / 1e6;
+		return r;
+	}
+
+	// Copy a recorded block into the buffer, main channels first then
+	// sidechain, as laid out by the processor's buses
+	template<typename SampleType>
+	void loadBlock(juce::AudioBuffer<SampleType> & buffer,
+			Recorder::Block const & block, void const * samples)
+	{
+		buffer.setSize(buffer.getNumChannels(), block.numSamples, false,
+				false, true);
+		buffer.clear();
+
+		auto src = static_cast<SampleType const *>(samples);
+		int const half = buffer.getNumChannels() / 2;
+		for (int j = 0; j < block.numMain + block.numSide; ++j)
+		{
+			int const channel = j < block.numMain
+				? j : half + j - block.numMain;
+			if (channel < buffer.getNumChannels())
+				buffer.copyFrom(channel, 0, src, block.numSamples);
+			src += block.numSamples;
+		}
+	}
+
+	int replay(SuperSeparator & proc, juce::File const & file, bool csv)
+	{
+		juce::MemoryMappedFile mapped(file,
+				juce::MemoryMappedFile::readOnly);
+		Recorder::Reader reader(mapped.getData(), mapped.getSize());
+		if (mapped.getData() == nullptr || !reader.isValid())
+		{
+			std::fprintf(stderr, "Not a recording, or from another"
+					" version: %s\n", file.getFullPathName().toRawUTF8());
+			return 1;
+		}
+
+		juce::AudioBuffer<float> floatBuffer;
+		juce::AudioBuffer<double> doubleBuffer;
+		juce::MidiBuffer midi;
+		double sampleRate = 0;
+		int sampleSize = 0;
+
+		int numBlocks = 0, numSkipped = 0, slowestBlock = -1;
+		uint32_t numGaps = 0;
+		juce::int64 numSamples = 0, ticks = 0, slowestTicks = -1;
+		double slowestBudget = 0;
+
+		if (csv)
+			std::printf("block,samples,us,budget_pct\n");
+
+		Recorder::RecordHeader header;
+		void const * payload;
+		while (reader.next(header, payload))
+		{
+			switch (header.type)
+			{
+				case Recorder::Type::prepare:
+				{
+					Recorder::Prepare p;
+					std::memcpy(&p, payload, sizeof(p));
+					sampleRate = p.sampleRate;
+					sampleSize = p.sampleSize;
+					proc.releaseResources();
+					proc.setNonRealtime(p.nonRealtime != 0);
+					proc.setProcessingPrecision(sampleSize == sizeof(double)
+							? juce::AudioProcessor::doublePrecision
+							: juce::AudioProcessor::singlePrecision);
+					proc.prepareToPlay(p.sampleRate, p.maxBlockSize);
+					floatBuffer.setSize(4, p.maxBlockSize);
+					doubleBuffer.setSize(4, p.maxBlockSize);
+					break;
+				}
+				case Recorder::Type::parameter:
+				{
+					Recorder::Parameter p;
+					std::memcpy(&p, payload, sizeof(p));
+					auto const & params = proc.getParameters();
+					if (p.index >= 0 && p.index < params.size())
+						params[p.index]->setValueNotifyingHost(p.value);
+					break;
+				}
+				case Recorder::Type::block:
+				{
+					Recorder::Block b;
+					std::memcpy(&b, payload, sizeof(b));
+					void const * samples = static_cast<char const *>(payload)
+						+ sizeof(b);
+					if (b.sampleSize != sampleSize || sampleRate <= 0)
+					{
+						++numSkipped;
+						break;
+					}
+
+					// Loaded outside the timed region, as processing is
+					// in-place
+					if (sampleSize == sizeof(double))
+						loadBlock(doubleBuffer, b, samples);
+					else
+						loadBlock(floatBuffer, b, samples);
+
+					auto const t0 = juce::Time::getHighResolutionTicks();
+					if (sampleSize == sizeof(double))
+						proc.processBlock(doubleBuffer, midi);
+					else
+						proc.processBlock(floatBuffer, midi);
+					auto const t = juce::Time::getHighResolutionTicks() - t0;
+
+					double const budget = juce::Time::
+						highResolutionTicksToSeconds(t) * sampleRate
+						/ b.numSamples * 100;
+					if (csv)
+					{
+						std::printf("%d,%d,%.3f,%.2f\n", numBlocks,
+								b.numSamples, juce::Time::
+								highResolutionTicksToSeconds(t) * 1e6,
+								budget);
+					}
+					if (t > slowestTicks)
+					{
+						slowestTicks = t;
+						slowestBlock = numBlocks;
+						slowestBudget = budget;
+					}
+					ticks += t;
+					numSamples += b.numSamples;
+					++numBlocks;
+					break;
+				}
+				case Recorder::Type::gap:
+				{
+					Recorder::Gap g;
+					std::memcpy(&g, payload, sizeof(g));
+					numGaps += g.numBlocks;
+					break;
+				}
+				default:
+					break;
+			}
+		}
+		proc.releaseResources();
+
+		if (!csv && numBlocks > 0)
+		{
+			double const seconds = juce::Time::highResolutionTicksToSeconds(
+					ticks);
+			std::printf("Replayed %d blocks, %lld samples: %.4f ns/sample\n"
+					"Slowest block: #%d, %.1f us, %.1f%% of real time\n",
+					numBlocks, static_cast<long long>(numSamples),
+					seconds * 1e9 / static_cast<double>(numSamples),
+					slowestBlock, juce::Time::highResolutionTicksToSeconds(
+						slowestTicks) * 1e6, slowestBudget);
+		}
+		if (numSkipped > 0)
+		{
+			std::fprintf(stderr, "Warning: skipped %d blocks not matching"
+					" the prepared precision\n", numSkipped);
+		}
+		if (numGaps > 0)
+		{
+			std::fprintf(stderr, "Warning: %u blocks were dropped while"
+					" recording, so replay isn't exact\n",
+					static_cast<unsigned>(numGaps));
+		}
+		return 0;
+	}
+
+	// Settings checked by --verify: whole-sample delays either way, which
+	// have a direct reference, then fractional, multiband, adaptive, and
+	// adaptive in mid/side with the sidechain routed in mono
+	struct VerifyConfig
+	{
+		char const * name;
+		float delay;
+		float fineDelay;
+		int bands;
+		int mode;
+		int channels;
+		int routing;
+	};
+
+	VerifyConfig constexpr verifyConfigs[] = {
+		{"delay", 1.0f, 0.0f, 1, 0, 0, 0},
+		{"negative", -15.0f, 0.0f, 1, 0, 0, 0},
+		{"fraction", 0.02f, 0.37f, 1, 0, 0, 0},
+		{"multiband", 1.0f, 0.0f, 3, 0, 0, 0},
+		{"adaptive", 0.0f, 0.0f, 1, 1, 0, 0},
+		{"midside", 0.0f, 0.0f, 1, 1, 1, 2}
+	};
+
+	double constexpr verifySampleRate = 48000;
+	int constexpr verifyLength = 1 << 16;
+	// Block size promised in prepareToPlay for every pattern but the
+	// reference, which is prepared for the whole signal
+	int constexpr verifyBlockSize = 512;
+
+	// Block sizes to split the signal into, cycled through until it's used
+	// up
+	struct VerifyPattern
+	{
+		char const * name;
+		std::vector<int> blockSizes;
+	};
+
+	// Largest difference from the reference allowed for each precision.
+	// Adaptive mode recomputes its input energy at chunk boundaries, so
+	// isn't bit exact.
+	double constexpr floatTolerance = 1e-5;
+	double constexpr doubleTolerance = 1e-12;
+
+	void setParameter(SuperSeparator & proc, char const * id, float value)
+	{
+		for (auto * param : proc.getParameters())
+		{
+			auto * ranged = dynamic_cast<juce::RangedAudioParameter *>(param);
+			if (ranged != nullptr && ranged->getParameterID() == id)
+				ranged->setValueNotifyingHost(ranged->convertTo0to1(value));
+		}
+	}
+
+	// Process the whole input in blocks of the given sizes, returning the
+	// output & latency
+	template<typename SampleType>
+	int processAll(SuperSeparator & proc, VerifyConfig const & cfg,
+			int prepareSize, std::vector<int> const & blockSizes,
+			juce::AudioBuffer<SampleType> const & input,
+			juce::AudioBuffer<SampleType> & output)
+	{
+		proc.setProcessingPrecision(sizeof(SampleType) == sizeof(double)
+				? juce::AudioProcessor::doublePrecision
+				: juce::AudioProcessor::singlePrecision);
+		setParameter(proc, "delay_ms", cfg.delay);
+		setParameter(proc, "delay_fraction", cfg.fineDelay);
+		setParameter(proc, "bands", static_cast<float>(cfg.bands));
+		setParameter(proc, "mode", static_cast<float>(cfg.mode));
+		setParameter(proc, "invert", 0);
+		setParameter(proc, "channels", static_cast<float>(cfg.channels));
+		setParameter(proc, "side_routing", static_cast<float>(cfg.routing));
+		proc.prepareToPlay(verifySampleRate, prepareSize);
+
+		juce::AudioBuffer<SampleType> buffer(input.getNumChannels(),
+				input.getNumSamples());
+		juce::MidiBuffer midi;
+		size_t next = 0;
+		for (int start = 0; start < input.getNumSamples(); )
+		{
+			int const n = juce::jmin(blockSizes[next],
+					input.getNumSamples() - start);
+			next = (next + 1) % blockSizes.size();
+
+			buffer.setSize(input.getNumChannels(), n, false, false, true);
+			for (int c = 0; c < input.getNumChannels(); ++c)
+				buffer.copyFrom(c, 0, input, c, start, n);
+			proc.processBlock(buffer, midi);
+			for (int c = 0; c < output.getNumChannels(); ++c)
+				output.copyFrom(c, start, buffer, c, 0, n);
+			start += n;
+		}
+
+		int const latency = proc.getLatencySamples();
+		proc.releaseResources();
+		return latency;
+	}
+
+	template<typename SampleType>
+	double maxDifference(juce::AudioBuffer<SampleType> const & a,
+			juce::AudioBuffer<SampleType> const & b)
+	{
+		double diff = 0;
+		for (int c = 0; c < a.getNumChannels(); ++c)
+		{
+			SampleType const * pa = a.getReadPointer(c);
+			SampleType const * pb = b.getReadPointer(c);
+			for (int i = 0; i < a.getNumSamples(); ++i)
+			{
+				diff = juce::jmax(diff, std::abs(static_cast<double>(pa[i])
+							- static_cast<double>(pb[i])));
+			}
+		}
+		return diff;
+	}
+
+	// Output for a whole-sample delay, worked out directly: the main input
+	// plus its delayed copy, plus the sidechain minus its delayed copy, all
+	// delayed by the latency
+	template<typename SampleType>
+	void directOutput(juce::AudioBuffer<SampleType> const & input,
+			int delay, int latency, juce::AudioBuffer<SampleType> & output)
+	{
+		int const half = input.getNumChannels() / 2;
+		auto at = [&](int c, int i)
+		{
+			return i >= 0 ? static_cast<double>(input.getSample(c, i)) : 0.0;
+		};
+
+		for (int c = 0; c < output.getNumChannels(); ++c)
+		{
+			for (int i = 0; i < output.getNumSamples(); ++i)
+			{
+				int const dry = i - latency;
+				int const wet = dry - delay;
+				output.setSample(c, i, static_cast<SampleType>(at(c, dry)
+							+ at(c, wet) + at(c + half, dry)
+							- at(c + half, wet)));
+			}
+		}
+	}
+
+	// Returns the number of failed checks
+	template<typename SampleType>
+	int verify(SuperSeparator & proc, bool csv)
+	{
+		// Noise on the sidechain, and main inputs made mostly of a delayed
+		// copy of it, so adaptive mode has something to cancel
+		juce::AudioBuffer<SampleType> input(4, verifyLength);
+		juce::Random rng(0x5eed);
+		for (int c = 0; c < 2; ++c)
+		{
+			SampleType * main = input.getWritePointer(c);
+			SampleType * side = input.getWritePointer(c + 2);
+			for (int i = 0; i < verifyLength; ++i)
+			{
+				side[i] = static_cast<SampleType>(rng.nextFloat() - 0.5f);
+				main[i] = static_cast<SampleType>((rng.nextFloat() - 0.5f)
+						* 0.1f) + (i >= 10 ? side[i - 10] / 2 : 0);
+			}
+		}
+
+		std::vector<VerifyPattern> const patterns = {
+			{"single", {1}},
+			{"host", {verifyBlockSize}},
+			{"irregular", {7, 129, 1, 1000, 3, verifyBlockSize, 64}},
+			{"oversized", {verifyLength}}
+		};
+
+		char const * prec = sizeof(SampleType) == sizeof(double)
+			? "double" : "float";
+		juce::AudioBuffer<SampleType> reference(2, verifyLength);
+		juce::AudioBuffer<SampleType> output(2, verifyLength);
+		int failures = 0;
+
+		auto report = [&](char const * config, char const * pattern,
+				double diff)
+		{
+			bool const ok = diff <= (sizeof(SampleType) == sizeof(double)
+					? doubleTolerance : floatTolerance);
+			failures += ok ? 0 : 1;
+			if (csv)
+			{
+				std::printf("%s,%s,%s,%g,%d\n", prec, config, pattern, diff,
+						ok ? 1 : 0);
+			}
+			else
+			{
+				std::printf("%-6s %-10s %-10s %12g %s\n", prec, config,
+						pattern, diff, ok ? "ok" : "FAIL");
+			}
+		};
+
+		for (auto const & cfg : verifyConfigs)
+		{
+			int const latency = processAll(proc, cfg, verifyLength,
+					{verifyLength}, input, reference);
+
+			if (cfg.fineDelay == 0 && cfg.bands == 1 && cfg.mode == 0
+					&& cfg.routing == 0)
+			{
+				int const delay = juce::roundToInt(cfg.delay
+						* verifySampleRate / 1000);
+				directOutput(input, delay, latency, output);
+				report(cfg.name, "direct", maxDifference(reference,
+							output));
+			}
+
+			for (auto const & pattern : patterns)
+			{
+				processAll(proc, cfg, verifyBlockSize, pattern.blockSizes,
+						input, output);
+				report(cfg.name, pattern.name, maxDifference(reference,
+							output));
+			}
+		}
+		return failures;
+	}
+
+	void usage()
+	{
+		std::printf("Usage: supsep-bench [--samples N] [--csv]"
+				" [--replay FILE | --verify]\n"
+				"  --samples N    samples processed per configuration"
+				" (default 1048576)\n"
+				"  --csv          machine-readable output\n"
+				"  --replay FILE  replay a recording made with"
+				" SUPSEP_RECORD set,\n"
+				"                 reporting the cost of each block\n"
+				"  --verify       check output doesn't depend on block"
+				" sizes\n");
+	}
+}
+
+int main(int argc, char * argv[])
+{
+	// Instance registration & latency reporting run on the message thread,
+	// so we need a message manager to exist
+	juce::ScopedJuceInitialiser_GUI juceInit;
+
+	// Our instances are nothing to do with any DAW session, so shouldn't
+	// be offered for linking there, or use up shared registry slots
+	SharedRegistry::get()->disable();
+
+	int totalSamples = 1 << 20;
+	bool csv = false;
+	bool verifyMode = false;
+	juce::File replayFile;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		juce::String arg(argv[i]);
+		if (arg == "--samples" && i + 1 < argc)
+		{
+			totalSamples = juce::String(argv[++i]).getIntValue();
+		}
+		else if (arg == "--csv")
+		{
+			csv = true;
+		}
+		else if (arg == "--replay" && i + 1 < argc)
+		{
+			replayFile = juce::File::getCurrentWorkingDirectory()
+				.getChildFile(argv[++i]);
+		}
+		else if (arg == "--verify")
+		{
+			verifyMode = true;
+		}
+		else
+		{
+			usage();
+			return arg == "--help" ? 0 : 1;
+		}
+	}
+
+	if (totalSamples <= 0)
+	{
+		usage();
+		return 1;
+	}
+
+	// One instance for the whole run, as a host would re-prepare an
+	// existing instance rather than construct a fresh one
+	auto proc = std::make_unique<SuperSeparator>();
+
+	if (replayFile != juce::File())
+		return replay(*proc, replayFile, csv);
+
+	if (verifyMode)
+	{
+		if (csv)
+			std::printf("precision,config,pattern,max_error,ok\n");
+		else
+			std::printf("%-6s %-10s %-10s %12s\n", "prec", "config",
+					"pattern", "max error");
+		int const failures = verify<float>(*proc, csv)
+			+ verify<double>(*proc, csv);
+		if (failures > 0)
+			std::fprintf(stderr, "%d checks failed\n", failures);
+		return failures > 0 ? 1 : 0;
+	}
+
+	// Warm up the counter calibration before we start timing anything
+	double const tickRate = CycleCounter::ticksPerSecond();
+
+	if (csv)
+	{
+		std::printf("precision,sample_rate,block_size,invert,delay_ms,"
+				"ns_per_sample,cycles_per_sample,msamples_per_sec\n");
+	}
+	else
+	{
+		std::printf("Counter rate: %.0f MHz\n", tickRate / 1e6);
+		std::printf("%-6s %7s %6s %6s %6s %12s %14s %12s\n", "prec",
+				"rate", "block", "invert", "ms", "ns/sample",
+				"cycles/sample", "Msamples/s");
+	}
+
+	for (bool dbl : {false, true})
+	{
+		for (double rate : sampleRates)
+		{
+			for (int block : blockSizes)
+			{
+				for (int invert : {0, 1})
+				{
+					for (float delay : delays)
+					{
+						Config cfg{dbl, rate, block, invert, delay};
+						Result r = dbl
+							? run<double>(*proc, cfg, totalSamples)
+							: run<float>(*proc, cfg, totalSamples);
+
+						char const * prec = dbl ? "double" : "float";
+						if (csv)
+						{
+							std::printf("%s,%.0f,%d,%d,%.2f,%.4f,%.4f,%.2f\n",
+									prec, rate, block, invert, delay,
+									r.nsPerSample, r.cyclesPerSample,
+									r.megaSamplesPerSecond);
+						}
+						else
+						{
+							std::printf("%-6s %7.0f %6d %6d %6.2f %12.4f "
+									"%14.4f %12.2f\n", prec, rate, block,
+									invert, delay, r.nsPerSample,
+									r.cyclesPerSample,
+									r.megaSamplesPerSecond);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <cstring>
+
+#include "AdaptiveFilter.h"
+
+namespace
+{
+	// Independent partial sums, so the reduction vectorises without needing
+	// the compiler to reassociate floating point adds
+	int constexpr dotLanes = 8;
+
+	template<typename SampleType>
+	SampleType dot(SampleType const * a, SampleType const * b, int n)
+	{
+		SampleType acc[dotLanes] = {};
+		int i = 0;
+		for (; i + dotLanes <= n; i += dotLanes)
+		{
+			for (int k = 0; k < dotLanes; ++k)
+				acc[k] += a[i + k] * b[i + k];
+		}
+		for (; i < n; ++i)
+			acc[0] += a[i] * b[i];
+
+		SampleType sum = 0;
+		for (int k = 0; k < dotLanes; ++k)
+			sum += acc[k];
+		return sum;
+	}
+
+	// Keeps the normalisation finite during silence
+	double constexpr regularisation = 1e-6;
+}
+
+template<typename SampleType>
+void AdaptiveFilter<SampleType>::prepare(int numChannels, int numTaps,
+		int maxBlockSize)
+{
+	jassert(numChannels > 0);
+	jassert(numTaps > 0);
+
+	m_numChannels = numChannels;
+	m_numTaps = numTaps;
+	m_maxBlockSize = juce::jmax(1, maxBlockSize);
+
+	m_weights.allocate(static_cast<size_t>(m_numChannels) * m_numTaps, true);
+	m_history.allocate(static_cast<size_t>(m_numChannels)
+			* (m_numTaps - 1 + m_maxBlockSize), true);
+}
+
+template<typename SampleType>
+void AdaptiveFilter<SampleType>::reset()
+{
+	m_weights.clear(static_cast<size_t>(m_numChannels) * m_numTaps);
+	m_history.clear(static_cast<size_t>(m_numChannels)
+			* (m_numTaps - 1 + m_maxBlockSize));
+}
+
+template<typename SampleType>
+void AdaptiveFilter<SampleType>::release()
+{
+	m_weights.free();
+	m_history.free();
+	m_numChannels = 0;
+	m_numTaps = 0;
+	m_maxBlockSize = 0;
+}
+
+template<typename SampleType>
+void AdaptiveFilter<SampleType>::process(int channel, SampleType const * main,
+		SampleType const * side, SampleType * dst, SampleType rate,
+		int numSamples)
+{
+	jassert(channel >= 0 && channel < m_numChannels);
+	jassert(numSamples <= m_maxBlockSize);
+
+	int const taps = m_numTaps;
+	SampleType * w = weights(channel);
+	SampleType * x = history(channel);
+
+	// Append new sidechain input after the retained history
+	juce::FloatVectorOperations::copy(x + taps - 1, side, numSamples);
+
+	// Window energy, kept up to date incrementally & recomputed every block
+	// so rounding errors can't accumulate
+	SampleType energy = dot(x, x, taps - 1);
+
+	for (int i = 0; i < numSamples; ++i)
+	{
+		SampleType const * window = x + i;
+		SampleType const newest = window[taps - 1];
+		energy += newest * newest;
+
+		SampleType const e = main[i] - dot(w, window, taps);
+		dst[i] = e;
+
+		SampleType const step = rate * e / static_cast<SampleType>(
+				juce::jmax(0.0, static_cast<double>(energy))
+				+ regularisation);
+		juce::FloatVectorOperations::addWithMultiply(w, window, step, taps);
+
+		energy -= window[0] * window[0];
+	}
+
+	// Keep the newest taps - 1 samples for next time. Source & destination
+	// overlap for blocks shorter than the filter.
+	std::memmove(x, x + numSamples, static_cast<size_t>(taps - 1)
+			* sizeof(SampleType));
+}
+
+template class AdaptiveFilter<float>;
+template class AdaptiveFilter<double>;
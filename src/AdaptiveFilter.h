@@ -0,0 +1,92 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <JuceHeader.h>
+
+#include "BufferPool.h"
+
+// Normalised LMS adaptive FIR, one per channel pair, which learns the filter
+// that best predicts the main input from the sidechain input and subtracts
+// that prediction. Used by the adaptive mode instead of a fixed delay &
+// polarity: whatever part of the main input the sidechain accounts for -
+// bleed, a delayed copy, a filtered copy - is cancelled, and keeps being
+// cancelled as the relationship drifts.
+//
+// Each channel keeps its sidechain history in one contiguous run, with the
+// newest samples appended after the oldest numTaps - 1, so the input window
+// for every output sample is a plain array slice. The per-sample filter and
+// weight update are then a dot product & a scaled add over numTaps values,
+// both of which vectorise; cost per sample is fixed by the tap count.
+template<typename SampleType>
+class AdaptiveFilter
+{
+	public:
+		AdaptiveFilter() = default;
+
+		// Allocate & clear storage. Not real-time safe; call from
+		// prepareToPlay.
+		void prepare(int numChannels, int numTaps, int maxBlockSize);
+
+		// Forget learnt filters & history without reallocating
+		void reset();
+
+		// Return storage to the pool. Must be prepared again before use.
+		void release();
+
+		int getNumTaps() const
+		{
+			return m_numTaps;
+		}
+
+		// Largest number of samples which may be passed to process() at
+		// once; zero if not prepared
+		int getMaxBlockSize() const
+		{
+			return m_maxBlockSize;
+		}
+
+		// Cancel the part of main predictable from side, for numSamples
+		// samples of one channel, writing the residual to dst. rate is the
+		// normalised step size, from 0 (frozen) up to 1 (fastest, noisiest).
+		// dst may alias main.
+		void process(int channel, SampleType const * main,
+				SampleType const * side, SampleType * dst, SampleType rate,
+				int numSamples);
+
+	private:
+		JUCE_DECLARE_NON_COPYABLE (AdaptiveFilter)
+
+		int m_numChannels = 0;
+		int m_numTaps = 0;
+		int m_maxBlockSize = 0;
+
+		// Per channel: weights, stored time-reversed so they line up with
+		// the history window, and the history itself
+		BufferPool::Block<SampleType> m_weights;
+		BufferPool::Block<SampleType> m_history;
+
+		SampleType * weights(int channel)
+		{
+			return m_weights.get() + static_cast<size_t>(channel) * m_numTaps;
+		}
+
+		SampleType * history(int channel)
+		{
+			return m_history.get() + static_cast<size_t>(channel)
+				* (m_numTaps - 1 + m_maxBlockSize);
+		}
+};
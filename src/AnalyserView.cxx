@@ -0,0 +1,230 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <cmath>
+#include <complex>
+
+#include "AnalyserView.h"
+#include "SuperSeparator.h"
+
+namespace
+{
+	int constexpr maxFramesPerSecond = 30;
+
+	double constexpr minFrequency = 20;
+	double constexpr maxFrequency = 20000;
+
+	// Range of the comb response plot
+	float constexpr minDb = -30;
+	float constexpr maxDb = 6;
+
+	juce::Colour const combColour{0xffff9933};
+	juce::Colour const coherenceColour{0xff33ccff};
+	juce::Colour const phaseColour{0xffeeeeee};
+
+	using Complex = std::complex<double>;
+
+	// Butterworth (Q = 1/sqrt(2)) second order sections, as used by the
+	// crossover, evaluated from their analogue prototypes at hz. Close
+	// enough to the digital filters for a plot.
+	Complex poles(Complex s)
+	{
+		return s * s + std::sqrt(2.0) * s + 1.0;
+	}
+
+	Complex lowPass(double hz, double fc)
+	{
+		Complex const s{0, hz / fc};
+		Complex const h = 1.0 / poles(s);
+		return h * h;
+	}
+
+	Complex highPass(double hz, double fc)
+	{
+		Complex const s{0, hz / fc};
+		Complex const h = s * s / poles(s);
+		return h * h;
+	}
+
+	Complex allPass(double hz, double fc)
+	{
+		Complex const s{0, hz / fc};
+		return (s * s - std::sqrt(2.0) * s + 1.0) / poles(s);
+	}
+
+	// Response of the main input at hz: each band's comb, weighted by how
+	// much of the input the crossover gives that band
+	double responseAt(SuperSeparator::Response const & r, double hz)
+	{
+		int constexpr maxBands = Crossover<float>::maxBands;
+		std::array<Complex, maxBands> bands{1.0};
+		if (r.numBands > 1)
+		{
+			Complex const upper = highPass(hz, r.crossoverLow);
+			bands[0] = lowPass(hz, r.crossoverLow);
+			bands[1] = upper;
+			if (r.numBands > 2)
+			{
+				bands[0] *= allPass(hz, r.crossoverHigh);
+				bands[1] = upper * lowPass(hz, r.crossoverHigh);
+				bands[2] = upper * highPass(hz, r.crossoverHigh);
+			}
+		}
+
+		Complex h;
+		for (int b = 0; b < juce::jmin(r.numBands, maxBands); ++b)
+		{
+			size_t const i = static_cast<size_t>(b);
+			Complex const delayed = std::polar(1.0,
+					-juce::MathConstants<double>::twoPi * hz * r.delays[i]);
+			h += bands[i] * (r.inverts[i] ? 1.0 - delayed : 1.0 + delayed);
+		}
+		return std::abs(h);
+	}
+}
+
+AnalyserView::AnalyserView(SuperSeparator & owner)
+	: m_owner(owner), m_analyser(owner.getSpectrumAnalyser())
+{
+	setOpaque(true);
+	m_analyser.start(m_owner.getSampleRate());
+	startTimerHz(maxFramesPerSecond);
+}
+
+AnalyserView::~AnalyserView()
+{
+	stopTimer();
+	m_analyser.stop();
+}
+
+void AnalyserView::timerCallback()
+{
+	// Restart the analyser if the host has changed sample rate under us
+	double const rate = m_owner.getSampleRate();
+	if (rate > 0 && rate != m_analyser.getSampleRate())
+	{
+		m_analyser.start(rate);
+		m_sequence = 0;
+	}
+
+	bool dirty = m_analyser.getResult(m_result, m_sequence);
+
+	auto const response = m_owner.getResponse();
+	if (response != m_response)
+	{
+		m_response = response;
+		dirty = true;
+	}
+
+	if (dirty)
+		repaint();
+}
+
+void AnalyserView::paint(juce::Graphics & g)
+{
+	g.fillAll(getLookAndFeel().findColour(
+				juce::ResizableWindow::backgroundColourId).darker());
+
+	auto const area = getLocalBounds().toFloat().reduced(2);
+	float const left = area.getX();
+	float const top = area.getY();
+	float const width = area.getWidth();
+	float const height = area.getHeight();
+	float const bottom = area.getBottom();
+
+	double const nyquist = m_analyser.getSampleRate() / 2;
+	double const fMax = juce::jmin(maxFrequency, nyquist > 0 ? nyquist
+			: maxFrequency);
+	double const logRange = std::log(fMax / minFrequency);
+	auto const xFor = [&](double hz)
+	{
+		return left + width * static_cast<float>(
+				std::log(hz / minFrequency) / logRange);
+	};
+
+	// Decade grid lines
+	g.setColour(juce::Colours::white.withAlpha(0.15f));
+	for (double hz = 100; hz < fMax; hz *= 10)
+		g.drawVerticalLine(juce::roundToInt(xFor(hz)), top, bottom);
+
+	// Comb response of the main input, |1 +/- e^(-jwt)| per band, drawn
+	// per pixel as it's cheap to compute directly
+	bool const showComb = !m_response.adaptive;
+	if (showComb)
+	{
+		juce::Path comb;
+		for (int px = 0; px <= static_cast<int>(width); ++px)
+		{
+			double const hz = minFrequency
+				* std::exp(logRange * px / width);
+			double const mag = responseAt(m_response, hz);
+			float const db = juce::jlimit(minDb, maxDb,
+					static_cast<float>(20 * std::log10(mag + 1e-9)));
+			float const y = top + height * (maxDb - db) / (maxDb - minDb);
+			if (px == 0)
+				comb.startNewSubPath(left, y);
+			else
+				comb.lineTo(left + static_cast<float>(px), y);
+		}
+		g.setColour(combColour);
+		g.strokePath(comb, juce::PathStrokeType(1.5f));
+	}
+
+	// Measured coherence & phase
+	int const numBins = static_cast<int>(m_result.coherence.size());
+	if (numBins > 0 && m_result.binWidth > 0)
+	{
+		int const first = juce::jmax(1, static_cast<int>(
+					std::ceil(minFrequency / m_result.binWidth)));
+		int const last = juce::jmin(numBins - 1, static_cast<int>(
+					fMax / m_result.binWidth));
+
+		juce::Path coherence;
+		for (int k = first; k <= last; ++k)
+		{
+			size_t const i = static_cast<size_t>(k);
+			float const x = xFor(k * m_result.binWidth);
+			float const y = bottom - height * m_result.coherence[i];
+			if (k == first)
+				coherence.startNewSubPath(x, y);
+			else
+				coherence.lineTo(x, y);
+
+			// Phase is meaningless where the inputs are unrelated
+			float const py = top + height * 0.5f * (1 - m_result.phase[i]
+					/ juce::MathConstants<float>::pi);
+			g.setColour(phaseColour.withAlpha(m_result.coherence[i]));
+			g.fillRect(x - 1, py - 1, 2.0f, 2.0f);
+		}
+		g.setColour(coherenceColour);
+		g.strokePath(coherence, juce::PathStrokeType(1.5f));
+	}
+
+	// Legend & correlation readout
+	auto text = getLocalBounds().reduced(6, 4);
+	g.setFont(12.0f);
+	g.setColour(phaseColour);
+	g.drawText(juce::String("Correlation ")
+			+ juce::String(m_result.correlation, 2),
+			text, juce::Justification::topRight);
+	g.setColour(coherenceColour);
+	g.drawText("Coherence", text, juce::Justification::topLeft);
+	if (showComb)
+	{
+		g.setColour(combColour);
+		g.drawText("Response", text.withTrimmedTop(14),
+				juce::Justification::topLeft);
+	}
+}
@@ -0,0 +1,54 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <JuceHeader.h>
+
+#include "SpectrumAnalyser.h"
+#include "SuperSeparator.h"
+
+// Editor panel plotting the relationship between main & sidechain inputs
+// against frequency, on a log scale: coherence as a line, phase difference
+// as points fading out where coherence is low, and the comb response the
+// current delay, invert & band settings give the main input - except in
+// adaptive mode, where there is no fixed response. Overall correlation is
+// shown as a number.
+//
+// Runs its owner's SpectrumAnalyser for as long as it exists, and repaints
+// from a timer at a capped rate, only when there are new results or the
+// settings have changed.
+class AnalyserView : public juce::Component, private juce::Timer
+{
+	public:
+		AnalyserView(SuperSeparator & owner);
+		~AnalyserView() override;
+
+		void paint(juce::Graphics & g) override;
+
+	private:
+		JUCE_DECLARE_NON_COPYABLE (AnalyserView)
+
+		void timerCallback() override;
+
+		SuperSeparator & m_owner;
+		SpectrumAnalyser & m_analyser;
+
+		SpectrumAnalyser::Result m_result;
+		uint32_t m_sequence = 0;
+
+		// Settings the comb response was last drawn for
+		SuperSeparator::Response m_response;
+};
@@ -0,0 +1,194 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <cmath>
+
+#include "AnalysisFifo.h"
+
+namespace
+{
+	template<typename SampleType>
+	void mixDown(float * dst, SampleType const * const * src, int numChannels,
+			int offset, int numSamples)
+	{
+		if (numChannels == 0)
+		{
+			juce::FloatVectorOperations::clear(dst, numSamples);
+			return;
+		}
+
+		float const gain = 1.0f / static_cast<float>(numChannels);
+		for (int i = 0; i < numSamples; ++i)
+		{
+			float sum = 0;
+			for (int c = 0; c < numChannels; ++c)
+				sum += static_cast<float>(src[c][offset + i]);
+			dst[i] = sum * gain;
+		}
+	}
+
+	// Cutoff of the anti-aliasing filter, as a fraction of the decimated
+	// rate: a little under Nyquist, and under the view's 20kHz at 48kHz.
+	// Droop near the cutoff doesn't matter, as both signals get the same
+	// filter, and consumers only look at how they relate.
+	double constexpr lowPassCutoff = 0.375;
+}
+
+void AnalysisFifo::prepare(int capacity, int decimation)
+{
+	m_decimation = juce::jmax(1, decimation);
+	m_phase = 0;
+
+	// Butterworth sections by bilinear transform, with their Qs spread
+	// so the cascade is maximally flat
+	int const numSections = static_cast<int>(m_lowPass.size());
+	double const w0 = juce::MathConstants<double>::twoPi * lowPassCutoff
+		/ m_decimation;
+	double const cosw = std::cos(w0);
+	for (int k = 0; k < numSections; ++k)
+	{
+		double const q = 1 / (2 * std::cos(juce::MathConstants<double>::pi
+					* (2 * k + 1) / (4 * numSections)));
+		double const alpha = std::sin(w0) / (2 * q);
+		double const a0 = 1 + alpha;
+
+		Section & s = m_lowPass[static_cast<size_t>(k)];
+		s = Section();
+		s.b0 = s.b2 = static_cast<float>((1 - cosw) / 2 / a0);
+		s.b1 = static_cast<float>((1 - cosw) / a0);
+		s.a1 = static_cast<float>(-2 * cosw / a0);
+		s.a2 = static_cast<float>((1 - alpha) / a0);
+	}
+
+	// AbstractFifo always leaves one slot empty to tell full from empty
+	m_fifo.setTotalSize(capacity + 1);
+	m_main.allocate(static_cast<size_t>(capacity) + 1, true);
+	m_side.allocate(static_cast<size_t>(capacity) + 1, true);
+	m_dropped.store(0, std::memory_order_relaxed);
+}
+
+template<typename SampleType>
+void AnalysisFifo::push(SampleType const * const * main, int numMain,
+		SampleType const * const * side, int numSide, int numSamples)
+{
+	if (m_decimation > 1)
+	{
+		pushDecimated(main, numMain, side, numSide, numSamples);
+		return;
+	}
+
+	int start1, size1, start2, size2;
+	m_fifo.prepareToWrite(numSamples, start1, size1, start2, size2);
+
+	mixDown(m_main + start1, main, numMain, 0, size1);
+	mixDown(m_side + start1, side, numSide, 0, size1);
+	mixDown(m_main + start2, main, numMain, size1, size2);
+	mixDown(m_side + start2, side, numSide, size1, size2);
+
+	m_fifo.finishedWrite(size1 + size2);
+
+	if (size1 + size2 < numSamples)
+	{
+		m_dropped.fetch_add(static_cast<uint32_t>(
+				numSamples - size1 - size2), std::memory_order_relaxed);
+	}
+}
+
+template<typename SampleType>
+void AnalysisFifo::pushDecimated(SampleType const * const * main,
+		int numMain, SampleType const * const * side, int numSide,
+		int numSamples)
+{
+	// Mix down & low pass every sample, keeping one in every m_decimation,
+	// collecting the results on the stack & writing them out a batch at a
+	// time
+	int constexpr batchSize = 64;
+	float mainOut[batchSize], sideOut[batchSize];
+	int n = 0;
+
+	float const mainGain = numMain > 0
+		? 1.0f / static_cast<float>(numMain) : 0.0f;
+	float const sideGain = numSide > 0
+		? 1.0f / static_cast<float>(numSide) : 0.0f;
+
+	for (int i = 0; i < numSamples; ++i)
+	{
+		float m = 0, s = 0;
+		for (int c = 0; c < numMain; ++c)
+			m += static_cast<float>(main[c][i]);
+		for (int c = 0; c < numSide; ++c)
+			s += static_cast<float>(side[c][i]);
+
+		m *= mainGain;
+		s *= sideGain;
+		for (Section & section : m_lowPass)
+		{
+			m = section.process(0, m);
+			s = section.process(1, s);
+		}
+
+		if (++m_phase < m_decimation)
+			continue;
+
+		mainOut[n] = m;
+		sideOut[n] = s;
+		m_phase = 0;
+		if (++n == batchSize)
+		{
+			write(mainOut, sideOut, n);
+			n = 0;
+		}
+	}
+	write(mainOut, sideOut, n);
+}
+
+void AnalysisFifo::write(float const * main, float const * side,
+		int numSamples)
+{
+	int start1, size1, start2, size2;
+	m_fifo.prepareToWrite(numSamples, start1, size1, start2, size2);
+
+	juce::FloatVectorOperations::copy(m_main + start1, main, size1);
+	juce::FloatVectorOperations::copy(m_side + start1, side, size1);
+	juce::FloatVectorOperations::copy(m_main + start2, main + size1, size2);
+	juce::FloatVectorOperations::copy(m_side + start2, side + size1, size2);
+
+	m_fifo.finishedWrite(size1 + size2);
+
+	if (size1 + size2 < numSamples)
+	{
+		m_dropped.fetch_add(static_cast<uint32_t>(
+				numSamples - size1 - size2), std::memory_order_relaxed);
+	}
+}
+
+int AnalysisFifo::pop(float * main, float * side, int numSamples)
+{
+	int start1, size1, start2, size2;
+	m_fifo.prepareToRead(numSamples, start1, size1, start2, size2);
+
+	juce::FloatVectorOperations::copy(main, m_main + start1, size1);
+	juce::FloatVectorOperations::copy(side, m_side + start1, size1);
+	juce::FloatVectorOperations::copy(main + size1, m_main + start2, size2);
+	juce::FloatVectorOperations::copy(side + size1, m_side + start2, size2);
+
+	m_fifo.finishedRead(size1 + size2);
+	return size1 + size2;
+}
+
+template void AnalysisFifo::push<float>(float const * const *, int,
+		float const * const *, int, int);
+template void AnalysisFifo::push<double>(double const * const *, int,
+		double const * const *, int, int);
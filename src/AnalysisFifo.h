@@ -0,0 +1,104 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+
+#include <JuceHeader.h>
+
+// Single-producer, single-consumer FIFO carrying mono mixdowns of the main
+// and sidechain inputs from the audio thread to a background analysis
+// thread. The producer never blocks or allocates: anything which doesn't fit
+// is dropped, and the consumer simply sees a discontinuity.
+//
+// Input may optionally be decimated on the way in, for consumers which don't
+// need the full bandwidth & would rather not pay for it. It's low passed
+// first, so content above the new Nyquist frequency doesn't alias down.
+class AnalysisFifo
+{
+	public:
+		AnalysisFifo() = default;
+
+		// Allocate storage for capacity samples, after decimating by the
+		// given factor. Must not be called while either end is in use.
+		void prepare(int capacity, int decimation = 1);
+
+		// Audio thread: mix down each bus to mono & push. A bus with no
+		// channels is pushed as silence.
+		template<typename SampleType>
+		void push(SampleType const * const * main, int numMain,
+				SampleType const * const * side, int numSide, int numSamples);
+
+		// Consumer thread: number of samples available to pop
+		int getNumReady() const
+		{
+			return m_fifo.getNumReady();
+		}
+
+		// Consumer thread: pop up to numSamples of each signal, returning the
+		// number actually popped
+		int pop(float * main, float * side, int numSamples);
+
+		// Consumer thread: throw away everything currently queued
+		void discard()
+		{
+			m_fifo.finishedRead(m_fifo.getNumReady());
+		}
+
+		// Number of samples dropped so far because the FIFO was full
+		uint32_t getNumDropped() const
+		{
+			return m_dropped.load(std::memory_order_relaxed);
+		}
+
+	private:
+		JUCE_DECLARE_NON_COPYABLE (AnalysisFifo)
+
+		template<typename SampleType>
+		void pushDecimated(SampleType const * const * main, int numMain,
+				SampleType const * const * side, int numSide,
+				int numSamples);
+
+		// Copy already mixed down samples in
+		void write(float const * main, float const * side, int numSamples);
+
+		juce::AbstractFifo m_fifo{1};
+		juce::HeapBlock<float> m_main;
+		juce::HeapBlock<float> m_side;
+		std::atomic<uint32_t> m_dropped{0};
+
+		// Transposed direct form II biquad, with state for main & side
+		struct Section
+		{
+			float b0 = 1, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+			float z1[2] = {};
+			float z2[2] = {};
+
+			float process(int lane, float x)
+			{
+				float const y = b0 * x + z1[lane];
+				z1[lane] = b1 * x - a1 * y + z2[lane];
+				z2[lane] = b2 * x - a2 * y;
+				return y;
+			}
+		};
+
+		// Decimation state, carried over between pushes: the anti-aliasing
+		// filter, an 8th order Butterworth low pass run at the input rate
+		int m_decimation = 1;
+		int m_phase = 0;
+		std::array<Section, 4> m_lowPass;
+};
@@ -0,0 +1,65 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <new>
+
+#include "BufferPool.h"
+
+BufferPool BufferPool::m_singleton;
+
+BufferPool::~BufferPool()
+{
+	for (int c = 0; c < numClasses; ++c)
+	{
+		for (void * block : m_free[static_cast<size_t>(c)])
+		{
+			::operator delete(block, size_t(1) << c,
+					std::align_val_t(alignment));
+		}
+	}
+}
+
+int BufferPool::sizeClass(size_t bytes)
+{
+	int c = minClass;
+	while ((size_t(1) << c) < bytes)
+		++c;
+	jassert(c < numClasses);
+	return c;
+}
+
+void * BufferPool::acquire(size_t bytes)
+{
+	int const c = sizeClass(bytes);
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		auto & list = m_free[static_cast<size_t>(c)];
+		if (!list.empty())
+		{
+			void * block = list.back();
+			list.pop_back();
+			return block;
+		}
+	}
+	return ::operator new(size_t(1) << c, std::align_val_t(alignment));
+}
+
+void BufferPool::release(void * block, size_t bytes)
+{
+	if (block == nullptr)
+		return;
+	std::lock_guard<std::mutex> l(m_mutex);
+	m_free[static_cast<size_t>(sizeClass(bytes))].push_back(block);
+}
@@ -0,0 +1,126 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include <JuceHeader.h>
+
+// Process-wide pool of processing storage, shared by every instance in the
+// process, in the same way as the InstanceManager. Blocks are handed out in
+// power-of-two size classes and go back on a free list when released, so a
+// session full of instances doesn't need one full-sized allocation per
+// instance per sample type: storage belongs only to instances which are
+// prepared, at the size they need, and is recycled between them as they
+// come & go or change sample rate.
+//
+// Every block is aligned to a cache line, which is also enough for any
+// vector load or store. Acquiring & releasing take a lock and may allocate,
+// so are not real-time safe; call them from prepareToPlay &
+// releaseResources.
+class BufferPool
+{
+	public:
+		BufferPool(BufferPool const &) = delete;
+		BufferPool & operator=(BufferPool const &) = delete;
+
+		static size_t constexpr alignment = 64;
+
+		// Get the singleton pointer
+		static BufferPool * get()
+		{
+			return &m_singleton;
+		}
+
+		// Get a block of at least the given size, with undefined contents
+		void * acquire(size_t bytes);
+
+		// Give back a block obtained from acquire, passing the same size
+		void release(void * block, size_t bytes);
+
+		// Drop-in for juce::HeapBlock, for arrays of samples allocated from
+		// the pool. Storage goes back to the pool when freed or destroyed.
+		template<typename ElementType>
+		class Block
+		{
+			public:
+				Block() = default;
+
+				~Block()
+				{
+					free();
+				}
+
+				Block(Block const &) = delete;
+				Block & operator=(Block const &) = delete;
+
+				void allocate(size_t numElements, bool initialiseToZero)
+				{
+					free();
+					if (numElements == 0)
+						return;
+					m_bytes = numElements * sizeof(ElementType);
+					m_data = static_cast<ElementType *>(
+							BufferPool::get()->acquire(m_bytes));
+					if (initialiseToZero)
+						std::memset(m_data, 0, m_bytes);
+				}
+
+				void free()
+				{
+					if (m_data != nullptr)
+						BufferPool::get()->release(m_data, m_bytes);
+					m_data = nullptr;
+					m_bytes = 0;
+				}
+
+				void clear(size_t numElements)
+				{
+					jassert(numElements * sizeof(ElementType) <= m_bytes);
+					if (m_data != nullptr)
+						std::memset(m_data, 0,
+								numElements * sizeof(ElementType));
+				}
+
+				ElementType * get() const
+				{
+					return m_data;
+				}
+
+			private:
+				ElementType * m_data = nullptr;
+				size_t m_bytes = 0;
+		};
+
+	private:
+		BufferPool() = default;
+		~BufferPool();
+
+		static BufferPool m_singleton;
+
+		// Smallest size class is 2^minClass bytes
+		static int constexpr minClass = 8;
+		static int constexpr numClasses = 32;
+
+		static int sizeClass(size_t bytes);
+
+		std::mutex m_mutex;
+		// Released blocks, by size class
+		std::array<std::vector<void *>, numClasses> m_free;
+};
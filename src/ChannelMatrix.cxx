@@ -0,0 +1,90 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "ChannelMatrix.h"
+
+namespace
+{
+	// Mixing in place needs a copy of the first channel's input; take it
+	// a run at a time, on the stack, so there's nothing to allocate
+	int constexpr runLength = 256;
+}
+
+template<typename SampleType>
+ChannelMatrix<SampleType>::ChannelMatrix(SampleType g00, SampleType g01,
+		SampleType g10, SampleType g11)
+	: m_gains{{g00, g01}, {g10, g11}}
+{
+}
+
+template<typename SampleType>
+ChannelMatrix<SampleType> ChannelMatrix<SampleType>::operator*(
+		ChannelMatrix const & other) const
+{
+	ChannelMatrix result;
+	for (int i = 0; i < numChannels; ++i)
+	{
+		for (int j = 0; j < numChannels; ++j)
+		{
+			result.m_gains[i][j] = m_gains[i][0] * other.m_gains[0][j]
+				+ m_gains[i][1] * other.m_gains[1][j];
+		}
+	}
+	return result;
+}
+
+template<typename SampleType>
+bool ChannelMatrix<SampleType>::isIdentity() const
+{
+	return m_gains[0][0] == 1 && m_gains[0][1] == 0
+		&& m_gains[1][0] == 0 && m_gains[1][1] == 1;
+}
+
+template<typename SampleType>
+void ChannelMatrix<SampleType>::apply(SampleType * const * channels,
+		int numSamples) const
+{
+	if (isIdentity())
+		return;
+
+	SampleType * const a = channels[0];
+	SampleType * const b = channels[1];
+	auto const & g = m_gains;
+
+	// Without cross terms, each channel is just scaled
+	if (g[0][1] == 0 && g[1][0] == 0)
+	{
+		juce::FloatVectorOperations::multiply(a, g[0][0], numSamples);
+		juce::FloatVectorOperations::multiply(b, g[1][1], numSamples);
+		return;
+	}
+
+	SampleType saved[runLength];
+	for (int start = 0; start < numSamples; start += runLength)
+	{
+		int const n = juce::jmin(runLength, numSamples - start);
+		SampleType * const x0 = a + start;
+		SampleType * const x1 = b + start;
+
+		juce::FloatVectorOperations::copy(saved, x0, n);
+		juce::FloatVectorOperations::multiply(x0, g[0][0], n);
+		juce::FloatVectorOperations::addWithMultiply(x0, x1, g[0][1], n);
+		juce::FloatVectorOperations::multiply(x1, g[1][1], n);
+		juce::FloatVectorOperations::addWithMultiply(x1, saved, g[1][0], n);
+	}
+}
+
+template class ChannelMatrix<float>;
+template class ChannelMatrix<double>;
@@ -0,0 +1,62 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <JuceHeader.h>
+
+// Two channel linear mix, applied in place: changing basis from left/right
+// to mid/side & back, or routing sidechain channels to different main
+// channels. Whole blocks go through a handful of FloatVectorOperations, so a
+// mix costs about as much as a couple of buffer copies - far less than
+// chaining separate routing plugins around this one.
+template<typename SampleType>
+class ChannelMatrix
+{
+	public:
+		static int constexpr numChannels = 2;
+
+		// Identity: each channel passes through unchanged
+		ChannelMatrix() = default;
+
+		// Gains from the first & second input channels to the first output
+		// channel, then the same for the second output channel
+		ChannelMatrix(SampleType g00, SampleType g01, SampleType g10,
+				SampleType g11);
+
+		// Mid is (left + right) / 2, side is (left - right) / 2
+		static ChannelMatrix midSideEncode()
+		{
+			return ChannelMatrix(SampleType(0.5), SampleType(0.5),
+					SampleType(0.5), SampleType(-0.5));
+		}
+
+		static ChannelMatrix midSideDecode()
+		{
+			return ChannelMatrix(1, 1, 1, -1);
+		}
+
+		// Mix which applies other, then this
+		ChannelMatrix operator*(ChannelMatrix const & other) const;
+
+		bool isIdentity() const;
+
+		// Mix numSamples of both channels, in place
+		void apply(SampleType * const * channels, int numSamples) const;
+
+	private:
+		// Gain from each input channel (column) to each output (row)
+		SampleType m_gains[numChannels][numChannels] = {{1, 0}, {0, 1}};
+};
@@ -0,0 +1,259 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+#include "Crossover.h"
+
+template<typename SampleType>
+void Crossover<SampleType>::prepare(double sampleRate, int maxBlockSize)
+{
+	jassert(sampleRate > 0);
+
+	m_sampleRate = sampleRate;
+	m_maxBlockSize = juce::jmax(1, maxBlockSize);
+
+	size_t const frameSize = static_cast<size_t>(numLanes) * m_maxBlockSize;
+	m_frames.allocate(frameSize * maxBands, true);
+	m_bands.allocate(frameSize * maxBands, true);
+	for (int b = 0; b < maxBands; ++b)
+	{
+		for (int c = 0; c < numLanes; ++c)
+		{
+			m_bandPointers[static_cast<size_t>(b)][static_cast<size_t>(c)]
+				= m_bands.get() + (static_cast<size_t>(b) * numLanes + c)
+					* m_maxBlockSize;
+		}
+	}
+
+	// Force coefficients to be recalculated for the new sample rate
+	double const low = m_low, high = m_high;
+	m_low = m_high = 0;
+	setFrequencies(low > 0 ? low : 250, high > 0 ? high : 2500);
+	reset();
+}
+
+template<typename SampleType>
+void Crossover<SampleType>::reset()
+{
+	resetUnused(1);
+}
+
+template<typename SampleType>
+void Crossover<SampleType>::resetUnused(int numBands)
+{
+	auto const clear = [](Section & s)
+	{
+		std::fill(std::begin(s.z1), std::end(s.z1), SampleType(0));
+		std::fill(std::begin(s.z2), std::end(s.z2), SampleType(0));
+	};
+
+	// Two bands only use the low crossover; three use everything
+	if (numBands < 2)
+	{
+		for (Filter * f : {&m_lowLowPass, &m_lowHighPass})
+		{
+			for (Section & s : *f)
+				clear(s);
+		}
+	}
+	if (numBands < 3)
+	{
+		for (Filter * f : {&m_highLowPass, &m_highHighPass})
+		{
+			for (Section & s : *f)
+				clear(s);
+		}
+		clear(m_highAllPass);
+	}
+}
+
+template<typename SampleType>
+void Crossover<SampleType>::release()
+{
+	m_frames.free();
+	m_bands.free();
+	m_bandPointers = {};
+	m_maxBlockSize = 0;
+}
+
+template<typename SampleType>
+void Crossover<SampleType>::setFrequencies(double low, double high)
+{
+	if (m_sampleRate <= 0)
+	{
+		m_low = low;
+		m_high = high;
+		return;
+	}
+
+	// Keep well clear of Nyquist, and keep the bands in order
+	double const limit = m_sampleRate * 0.45;
+	low = juce::jlimit(10.0, limit, low);
+	high = juce::jlimit(low, limit, high);
+
+	if (low != m_low)
+	{
+		m_low = low;
+		for (Section & s : m_lowLowPass)
+			design(s, Response::lowPass, low, m_sampleRate);
+		for (Section & s : m_lowHighPass)
+			design(s, Response::highPass, low, m_sampleRate);
+	}
+
+	if (high != m_high)
+	{
+		m_high = high;
+		for (Section & s : m_highLowPass)
+			design(s, Response::lowPass, high, m_sampleRate);
+		for (Section & s : m_highHighPass)
+			design(s, Response::highPass, high, m_sampleRate);
+		design(m_highAllPass, Response::allPass, high, m_sampleRate);
+	}
+}
+
+template<typename SampleType>
+void Crossover<SampleType>::design(Section & s, Response response,
+		double frequency, double sampleRate)
+{
+	// Bilinear transform of a Butterworth (Q = 1/sqrt(2)) second order
+	// section. Squaring the low & high pass gives the LR4 pair, which sums to
+	// the allpass with the same poles.
+	double const w0 = juce::MathConstants<double>::twoPi * frequency
+		/ sampleRate;
+	double const cosw = std::cos(w0);
+	double const alpha = std::sin(w0) / std::sqrt(2.0);
+	double const a0 = 1 + alpha;
+
+	double b0, b1, b2;
+	switch (response)
+	{
+		case Response::lowPass:
+			b0 = b2 = (1 - cosw) / 2;
+			b1 = 1 - cosw;
+			break;
+		case Response::highPass:
+			b0 = b2 = (1 + cosw) / 2;
+			b1 = -(1 + cosw);
+			break;
+		case Response::allPass:
+		default:
+			b0 = 1 - alpha;
+			b1 = -2 * cosw;
+			b2 = 1 + alpha;
+			break;
+	}
+
+	s.b0 = static_cast<SampleType>(b0 / a0);
+	s.b1 = static_cast<SampleType>(b1 / a0);
+	s.b2 = static_cast<SampleType>(b2 / a0);
+	s.a1 = static_cast<SampleType>(-2 * cosw / a0);
+	s.a2 = static_cast<SampleType>((1 - alpha) / a0);
+}
+
+template<typename SampleType>
+void Crossover<SampleType>::Section::process(SampleType const * in,
+		SampleType * out, int numFrames)
+{
+	// Work on local copies of the state, so the compiler can keep each set
+	// of lanes in a single vector register
+	SampleType s1[numLanes], s2[numLanes];
+	for (int c = 0; c < numLanes; ++c)
+	{
+		s1[c] = z1[c];
+		s2[c] = z2[c];
+	}
+
+	for (int i = 0; i < numFrames; ++i)
+	{
+		SampleType const * x = in + i * numLanes;
+		SampleType * y = out + i * numLanes;
+		for (int c = 0; c < numLanes; ++c)
+		{
+			SampleType const xc = x[c];
+			SampleType const yc = b0 * xc + s1[c];
+			s1[c] = b1 * xc - a1 * yc + s2[c];
+			s2[c] = b2 * xc - a2 * yc;
+			y[c] = yc;
+		}
+	}
+
+	for (int c = 0; c < numLanes; ++c)
+	{
+		z1[c] = s1[c];
+		z2[c] = s2[c];
+	}
+}
+
+template<typename SampleType>
+void Crossover<SampleType>::split(SampleType const * const * lanes,
+		int numBands, int numSamples)
+{
+	jassert(numBands == 2 || numBands == 3);
+	jassert(numSamples <= m_maxBlockSize);
+
+	// Interleave input into frames
+	SampleType * low = frames(0);
+	for (int c = 0; c < numLanes; ++c)
+	{
+		SampleType const * src = lanes[c];
+		if (src == nullptr)
+		{
+			for (int i = 0; i < numSamples; ++i)
+				low[i * numLanes + c] = 0;
+		}
+		else
+		{
+			for (int i = 0; i < numSamples; ++i)
+				low[i * numLanes + c] = src[i];
+		}
+	}
+
+	// Split at the low crossover. The high pass has to read the input
+	// before the low pass overwrites it in place.
+	SampleType * mid = frames(1);
+	SampleType * high = frames(2);
+	process(m_lowHighPass, low, high, numSamples);
+	process(m_lowLowPass, low, low, numSamples);
+
+	SampleType * bandFrames[maxBands] = {low, high, nullptr};
+	if (numBands == 3)
+	{
+		// Split the upper band again, and allpass the low band to match
+		process(m_highLowPass, high, mid, numSamples);
+		process(m_highHighPass, high, high, numSamples);
+		m_highAllPass.process(low, low, numSamples);
+		bandFrames[1] = mid;
+		bandFrames[2] = high;
+	}
+
+	// De-interleave into per-lane runs
+	for (int b = 0; b < numBands; ++b)
+	{
+		SampleType const * src = bandFrames[b];
+		auto const & dst = m_bandPointers[static_cast<size_t>(b)];
+		for (int c = 0; c < numLanes; ++c)
+		{
+			SampleType * d = dst[static_cast<size_t>(c)];
+			for (int i = 0; i < numSamples; ++i)
+				d[i] = src[i * numLanes + c];
+		}
+	}
+}
+
+template class Crossover<float>;
+template class Crossover<double>;
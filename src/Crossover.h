@@ -0,0 +1,153 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <cmath>
+
+#include <JuceHeader.h>
+
+#include "BufferPool.h"
+
+// Linkwitz-Riley (4th order) crossover filterbank, splitting all four input
+// channels - main L/R & sidechain L/R - into two or three bands which sum
+// back to an allpassed copy of the input.
+//
+// Filtering is done in structure-of-arrays form: input is interleaved into
+// frames of one sample per channel, and each biquad section runs across all
+// four lanes of a frame at once, so the inner loop has a constant trip count
+// and vectorises across channels rather than fighting the recursion along
+// time. Bands are handed back de-interleaved, one run per channel.
+template<typename SampleType>
+class Crossover
+{
+	public:
+		static int constexpr numLanes = 4;
+		static int constexpr maxBands = 3;
+
+		Crossover() = default;
+
+		// Allocate & clear storage. Not real-time safe; call from
+		// prepareToPlay.
+		void prepare(double sampleRate, int maxBlockSize);
+
+		// Clear filter state without reallocating
+		void reset();
+
+		// Clear the state of only those filters not used when splitting
+		// into numBands bands, so more bands can be brought into use without
+		// disturbing the ones already playing
+		void resetUnused(int numBands);
+
+		// Return storage to the pool. Must be prepared again before use.
+		void release();
+
+		// Set crossover frequencies in Hz; the high one is only used when
+		// splitting into three bands. Coefficients are only recalculated
+		// when frequencies actually change. Before prepare() they're just
+		// stored, to be applied once the sample rate is known.
+		void setFrequencies(double low, double high);
+
+		// Roughly how many samples the filters take to ring down to -120dB
+		// once input stops: the slowest poles, at the low crossover, decay
+		// by 120dB in a little over three cycles
+		int getTailLength() const
+		{
+			return m_low > 0 ? static_cast<int>(std::ceil(4 * m_sampleRate
+						/ m_low)) : 0;
+		}
+
+		// Largest number of samples which may be passed to split() at once;
+		// zero if not prepared
+		int getMaxBlockSize() const
+		{
+			return m_maxBlockSize;
+		}
+
+		// Split numSamples of input into numBands (2 or 3) bands, lowest
+		// first. Lanes given as null are treated as silence.
+		void split(SampleType const * const * lanes, int numBands,
+				int numSamples);
+
+		// Output of the last split() for the given band, one pointer per
+		// lane
+		SampleType * const * getBand(int band) const
+		{
+			return m_bandPointers[static_cast<size_t>(band)].data();
+		}
+
+	private:
+		JUCE_DECLARE_NON_COPYABLE (Crossover)
+
+		// Transposed direct form II biquad, with one set of state per lane
+		struct Section
+		{
+			SampleType b0 = 1, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+			SampleType z1[numLanes] = {};
+			SampleType z2[numLanes] = {};
+
+			// in & out are frames of numLanes samples, and may be the same
+			void process(SampleType const * in, SampleType * out,
+					int numFrames);
+		};
+
+		enum class Response
+		{
+			lowPass,
+			highPass,
+			allPass
+		};
+
+		static void design(Section & s, Response response, double frequency,
+				double sampleRate);
+
+		// Two cascaded Butterworth sections per LR4 filter
+		using Filter = std::array<Section, 2>;
+
+		static void process(Filter & f, SampleType const * in,
+				SampleType * out, int numFrames)
+		{
+			f[0].process(in, out, numFrames);
+			f[1].process(out, out, numFrames);
+		}
+
+		double m_sampleRate = 0;
+		double m_low = 0;
+		double m_high = 0;
+		int m_maxBlockSize = 0;
+
+		Filter m_lowLowPass;
+		Filter m_lowHighPass;
+		Filter m_highLowPass;
+		Filter m_highHighPass;
+		// Gives the low band the same phase response as the mid & high bands
+		// combined, so all three sum flat
+		Section m_highAllPass;
+
+		// Interleaved working frames: input (becoming the low band), mid &
+		// high bands
+		BufferPool::Block<SampleType> m_frames;
+		// De-interleaved output, band-major then lane-major
+		BufferPool::Block<SampleType> m_bands;
+		std::array<std::array<SampleType *, numLanes>, maxBands>
+			m_bandPointers{};
+
+		SampleType * frames(int index)
+		{
+			return m_frames.get()
+				+ static_cast<size_t>(index) * numLanes * m_maxBlockSize;
+		}
+};
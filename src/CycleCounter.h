@@ -0,0 +1,72 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstdint>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <JuceHeader.h>
+
+// Low-overhead timestamp source for profiling the processing callbacks.
+// Reads the CPU's own counter where there is one we can get at from user
+// space, otherwise falls back to JUCE's high resolution ticks.
+class CycleCounter
+{
+	public:
+		CycleCounter() = delete;
+
+		static uint64_t now() noexcept
+		{
+#if (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))) \
+			|| defined(__x86_64__) || defined(__i386__)
+			return __rdtsc();
+#elif defined(__aarch64__)
+			uint64_t v;
+			asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+			return v;
+#else
+			return static_cast<uint64_t>(
+					juce::Time::getHighResolutionTicks());
+#endif
+		}
+
+		// Rate at which now() advances, measured once against JUCE's high
+		// resolution clock on first use. Not real-time safe on first call.
+		static double ticksPerSecond()
+		{
+			static double const rate = calibrate();
+			return rate;
+		}
+
+	private:
+		static double calibrate()
+		{
+			auto const t0 = juce::Time::getHighResolutionTicks();
+			auto const c0 = now();
+			juce::Thread::sleep(20);
+			auto const t1 = juce::Time::getHighResolutionTicks();
+			auto const c1 = now();
+
+			double const seconds = juce::Time::highResolutionTicksToSeconds(
+					t1 - t0);
+			return static_cast<double>(c1 - c0) / seconds;
+		}
+};
@@ -17,41 +17,175 @@
 
 DebugLog DebugLog::m_singleton;
 
-void DebugLog::pLog(juce::String const & name, juce::String const & msg,
-		bool reset)
+void DebugLog::start()
 {
-	std::unique_lock<std::mutex> l(m_mutex);
+	std::lock_guard<std::mutex> l(m_startMutex);
+	if (m_started.load(std::memory_order_relaxed))
+		return;
 
-	if (m_init)
+	m_slots.reset(new Slot[capacity]);
+	for (int i = 0; i < capacity; ++i)
+		m_slots[i].seq.store(static_cast<uint64_t>(i),
+				std::memory_order_relaxed);
+
+	m_logger.reset(juce::FileLogger::createDateStampedLogger(
+			juce::String(ProjectInfo::companyName) + '/'
+				+ ProjectInfo::projectName,
+			juce::String(ProjectInfo::versionString).replace(".","_")
+				+ '-',
+			".txt",
+			juce::String(ProjectInfo::projectName) + ' '
+				+ ProjectInfo::versionString));
+	juce::Logger::setCurrentLogger(m_logger.get());
+
+	m_writer.reset(new Writer(this));
+	m_writer->startThread();
+
+	m_started.store(true, std::memory_order_release);
+}
+
+void DebugLog::pLog(juce::String const & name, char const * msg,
+		bool hasValue, juce::int64 value, bool reset)
+{
+	// Only ever contended the very first time anything is logged
+	if (!m_started.load(std::memory_order_acquire))
+		start();
+
+	if (!reset && !m_firstLog.exchange(false))
+		return;
+
+	Record r;
+	r.time = juce::Time::currentTimeMillis();
+	name.copyToUTF8(r.name, sizeof(r.name));
+
+	// Split long messages over as many records as it takes, without
+	// breaking up multi-byte characters. Only the last gets the value.
+	size_t remaining = std::strlen(msg);
+	do
 	{
-		m_init = false;
-		m_logger.reset(juce::FileLogger::createDateStampedLogger(
-				juce::String(ProjectInfo::companyName) + '/'
-					+ ProjectInfo::projectName,
-				juce::String(ProjectInfo::versionString).replace(".","_")
-					+ '-',
-				".txt",
-				juce::String(ProjectInfo::projectName) + ' '
-					+ ProjectInfo::versionString));
-		juce::Logger::setCurrentLogger(m_logger.get());
+		size_t n = juce::jmin(remaining, sizeof(r.msg) - 1);
+		while (n < remaining && n > 0
+				&& (static_cast<unsigned char>(msg[n]) & 0xc0) == 0x80)
+			--n;
+
+		std::memcpy(r.msg, msg, n);
+		r.msg[n] = '\0';
+		msg += n;
+		remaining -= n;
+
+		r.hasValue = hasValue && remaining == 0;
+		r.value = value;
+		if (!push(r))
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
 	}
+	while (remaining > 0);
 
-	if (m_firstLog || reset)
+	if (reset)
+		m_firstLog.store(true);
+}
+
+bool DebugLog::push(Record const & r)
+{
+	uint64_t pos = m_head.load(std::memory_order_relaxed);
+	Slot * slot;
+	for (;;)
 	{
-		m_logger->logMessage(
-				juce::Time::getCurrentTime().formatted("%Y%m%d %H:%M:%S ")
-				+ name + " " + msg);
-		m_firstLog = false;
+		slot = &m_slots[pos % capacity];
+		uint64_t const seq = slot->seq.load(std::memory_order_acquire);
+		auto const diff = static_cast<juce::int64>(seq - pos);
+
+		if (diff == 0)
+		{
+			// Slot is free; try to claim it
+			if (m_head.compare_exchange_weak(pos, pos + 1,
+					std::memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			// Consumer hasn't got this far yet; ring is full
+			return false;
+		}
+		else
+		{
+			// Another producer got here first
+			pos = m_head.load(std::memory_order_relaxed);
+		}
+	}
+
+	slot->record = r;
+	slot->seq.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+bool DebugLog::pop(Record & r)
+{
+	Slot & slot = m_slots[m_tail % capacity];
+	if (slot.seq.load(std::memory_order_acquire) != m_tail + 1)
+		return false;
+
+	r = slot.record;
+	slot.seq.store(m_tail + capacity, std::memory_order_release);
+	++m_tail;
+	return true;
+}
+
+void DebugLog::write(Record const & r)
+{
+	juce::String line = juce::Time(r.time).formatted("%Y%m%d %H:%M:%S ");
+	line += juce::String::fromUTF8(r.name);
+	line += ' ';
+	line += juce::String::fromUTF8(r.msg);
+	if (r.hasValue)
+	{
+		line += ' ';
+		line += r.value;
+	}
+	m_logger->logMessage(line);
+}
+
+void DebugLog::drain()
+{
+	Record r;
+	while (pop(r))
+		write(r);
+
+	uint32_t const dropped = m_dropped.exchange(0);
+	if (dropped > 0)
+	{
+		m_logger->logMessage(juce::String("logger: ring full, dropped ")
+				+ juce::String(dropped) + " messages");
 	}
-	if (reset)
-		m_firstLog = true;
 }
 
 DebugLog::~DebugLog()
 {
-	if (!m_init)
+	if (m_started.load())
 	{
 		log("logger", "Destroying logger");
+		// Writer drains anything still queued before exiting
+		m_writer->stopThread(2000);
 		juce::Logger::setCurrentLogger(nullptr);
 	}
 }
+
+//
+// Writer thread
+//
+
+DebugLog::Writer::Writer(DebugLog * log)
+	: juce::Thread("Debug log writer"), m_log(log)
+{
+}
+
+void DebugLog::Writer::run()
+{
+	// Poll rather than have producers signal us, as waking a thread isn't
+	// something we want to do from the audio thread
+	while (!threadShouldExit())
+	{
+		m_log->drain();
+		wait(50);
+	}
+	m_log->drain();
+}
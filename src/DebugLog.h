@@ -15,11 +15,20 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstring>
 #include <memory>
 #include <mutex>
 
 #include <JuceHeader.h>
 
+// Logging to a date-stamped file, safe for use on the audio thread.
+//
+// Callers copy their message into a fixed-size record in a lock-free ring
+// buffer; a background thread takes records off the other end, formats them
+// and writes them to the file. Producers never block or allocate - if the
+// ring is full, the message is dropped and counted, and the writer notes how
+// many were lost.
 class DebugLog
 {
 	public:
@@ -33,10 +42,28 @@ class DebugLog
 		// first such message will actually be recorded; this allows e.g.
 		// recording a message on first entering the processing callback in
 		// the main audio thread without spamming it during rendering.
+		// Messages too long for a single record are split over several.
 		static void log(juce::String const & name, juce::String const & msg,
 				bool reset = true)
 		{
-			m_singleton.pLog(name, msg, reset);
+			m_singleton.pLog(name, msg.toRawUTF8(), false, 0, reset);
+		}
+
+		// As above, but with a number appended to the message by the writer
+		// thread, so callers on the audio thread don't need to build strings.
+		// Pass string literals as-is rather than converting to juce::String,
+		// as that would allocate.
+		static void logValue(juce::String const & name, char const * msg,
+				juce::int64 value, bool reset = true)
+		{
+			m_singleton.pLog(name, msg, true, value, reset);
+		}
+
+		static void logValue(juce::String const & name,
+				juce::String const & msg, juce::int64 value,
+				bool reset = true)
+		{
+			m_singleton.pLog(name, msg.toRawUTF8(), true, value, reset);
 		}
 
 	private:
@@ -45,11 +72,55 @@ class DebugLog
 
 		static DebugLog m_singleton;
 
+		struct Record
+		{
+			juce::int64 time;
+			juce::int64 value;
+			bool hasValue;
+			char name[32];
+			char msg[192];
+		};
+
+		// Bounded multi-producer, single-consumer queue slot. The sequence
+		// number says whether the slot is free for the producer claiming
+		// position n (seq == n) or holds a record for the consumer (seq ==
+		// n + 1).
+		struct Slot
+		{
+			std::atomic<uint64_t> seq;
+			Record record;
+		};
+
+		static int constexpr capacity = 1024;
+
+		class Writer : public juce::Thread
+		{
+			public:
+				Writer(DebugLog * log);
+				void run() override;
+
+			private:
+				DebugLog * m_log;
+		};
+
+		// Writer thread & queue are created on first use, so builds which
+		// never log don't pay for them
+		std::atomic<bool> m_started{false};
+		std::mutex m_startMutex;
+		std::unique_ptr<Slot[]> m_slots;
+		std::unique_ptr<Writer> m_writer;
 		std::unique_ptr<juce::FileLogger> m_logger;
-		std::mutex m_mutex;
-		bool m_init = true;
-		bool m_firstLog = false;
 
-		void pLog(juce::String const & name, juce::String const & msg,
-				bool reset);
+		std::atomic<uint64_t> m_head{0};
+		uint64_t m_tail = 0;
+		std::atomic<uint32_t> m_dropped{0};
+		std::atomic<bool> m_firstLog{false};
+
+		void start();
+		void pLog(juce::String const & name, char const * msg,
+				bool hasValue, juce::int64 value, bool reset);
+		bool push(Record const & r);
+		bool pop(Record & r);
+		void write(Record const & r);
+		void drain();
 };
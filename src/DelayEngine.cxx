@@ -0,0 +1,322 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "DelayEngine.h"
+
+template<typename SampleType>
+void DelayEngine<SampleType>::prepare(int numChannels, int maxDelay,
+		int maxBlockSize, int fadeLength)
+{
+	jassert(numChannels > 0);
+	jassert(maxDelay >= 0);
+	jassert(fadeLength >= 0);
+
+	m_numChannels = numChannels;
+	m_maxDelay = maxDelay;
+	m_size = juce::nextPowerOfTwo(maxDelay + highOrder
+			+ juce::jmax(1, maxBlockSize));
+	m_mask = m_size - 1;
+
+	m_buffer.allocate(static_cast<size_t>(m_numChannels) * m_size, true);
+	m_writePos = 0;
+
+	// Linear ramps, reaching full gain on the last sample of the fade. The
+	// old & new taps read the same signal at nearby delays, so are well
+	// correlated, and a constant gain crossfade is what keeps the level
+	// steady.
+	m_fadeLength = juce::jmax(0, fadeLength);
+	if (m_fadeLength > 0)
+	{
+		m_ramps.allocate(2 * static_cast<size_t>(m_fadeLength), false);
+		m_scratch.allocate(2 * static_cast<size_t>(getMaxChunkSize()),
+				false);
+		SampleType * rampIn = m_ramps.get();
+		SampleType * rampOut = rampIn + m_fadeLength;
+		for (int i = 0; i < m_fadeLength; ++i)
+		{
+			rampIn[i] = static_cast<SampleType>(i + 1) / m_fadeLength;
+			rampOut[i] = 1 - rampIn[i];
+		}
+	}
+	else
+	{
+		m_ramps.free();
+		m_scratch.free();
+	}
+
+	// Re-clamp settings to the new range, without fading
+	m_running = false;
+	m_fading = false;
+	m_tap = m_target = makeTap(m_target.delay - m_target.latency,
+			m_target.fraction, m_target.latency);
+}
+
+template<typename SampleType>
+void DelayEngine<SampleType>::release()
+{
+	m_buffer.free();
+	m_ramps.free();
+	m_scratch.free();
+	m_numChannels = 0;
+	m_size = 0;
+	m_mask = 0;
+	m_writePos = 0;
+	m_fadeLength = 0;
+	m_running = false;
+	m_fading = false;
+}
+
+template<typename SampleType>
+void DelayEngine<SampleType>::setDelay(int delay, SampleType fraction,
+		int latency)
+{
+	m_target = makeTap(delay, fraction, latency);
+	if (!m_fading)
+		startFade();
+}
+
+template<typename SampleType>
+void DelayEngine<SampleType>::setInterpolationOrder(int order)
+{
+	order = juce::jlimit(1, highOrder, order);
+	if (order == m_order)
+		return;
+
+	m_order = order;
+	m_target = makeTap(m_target.delay - m_target.latency, m_target.fraction,
+			m_target.latency);
+	if (!m_fading)
+		startFade();
+}
+
+template<typename SampleType>
+typename DelayEngine<SampleType>::Tap DelayEngine<SampleType>::makeTap(
+		int delay, SampleType fraction, int latency) const
+{
+	Tap tap;
+	tap.latency = juce::jlimit(0, m_maxDelay, latency);
+	tap.delay = juce::jlimit(0, m_maxDelay, tap.latency + delay);
+	tap.fraction = tap.delay < m_maxDelay
+		? juce::jlimit(SampleType(0), SampleType(1), fraction) : 0;
+	if (tap.fraction >= 1)
+	{
+		++tap.delay;
+		tap.fraction = 0;
+	}
+
+	if (tap.fraction == 0)
+		return tap;
+
+	// Lagrange interpolation, ideally with the wanted delay between the
+	// middle two taps. The taps can't reach forward in time, so for delays
+	// shorter than half the order they sit further behind it instead. That
+	// gets much worse towards Nyquist as the order goes up, so orders above
+	// the default are cut back to what can be kept centred. Weights are
+	// worked out in double precision, as high orders multiply together a
+	// lot of terms.
+	tap.order = m_order <= standardOrder ? m_order : juce::jmax(
+			standardOrder, juce::jmin(m_order, 2 * tap.delay + 1));
+	tap.tapDelay = juce::jmax(0, tap.delay - (tap.order - 1) / 2);
+	double const p = tap.delay - tap.tapDelay
+		+ static_cast<double>(tap.fraction);
+	for (int k = 0; k <= tap.order; ++k)
+	{
+		double weight = 1;
+		for (int m = 0; m <= tap.order; ++m)
+		{
+			if (m != k)
+				weight *= (p - m) / (k - m);
+		}
+		tap.taps[k] = static_cast<SampleType>(weight);
+	}
+	return tap;
+}
+
+template<typename SampleType>
+void DelayEngine<SampleType>::startFade()
+{
+	if (m_target.sameAs(m_tap))
+		return;
+
+	if (m_running && m_fadeLength > 0 && m_ramps.get() != nullptr)
+	{
+		m_fadeFrom = m_tap;
+		m_fadePos = 0;
+		m_fading = true;
+	}
+	m_tap = m_target;
+}
+
+template<typename SampleType>
+void DelayEngine<SampleType>::finishFade()
+{
+	m_fading = false;
+	startFade();
+}
+
+template<typename SampleType>
+void DelayEngine<SampleType>::reset()
+{
+	m_buffer.clear(static_cast<size_t>(m_numChannels) * m_size);
+	m_writePos = 0;
+	m_running = false;
+	m_fading = false;
+	m_tap = m_target;
+}
+
+template<typename SampleType>
+void DelayEngine<SampleType>::clearChannel(int channel)
+{
+	jassert(channel >= 0 && channel < m_numChannels);
+	juce::FloatVectorOperations::clear(channelData(channel), m_size);
+}
+
+template<typename SampleType>
+template<bool Subtract, bool Accumulate>
+void DelayEngine<SampleType>::process(int channel, SampleType const * src,
+		SampleType * dst, int numSamples)
+{
+	jassert(channel >= 0 && channel < m_numChannels);
+	jassert(numSamples <= getMaxChunkSize());
+
+	SampleType * ring = channelData(channel);
+
+	// Copy input into history. Must happen before touching dst, which may
+	// alias src.
+	int const n1 = juce::jmin(numSamples, m_size - m_writePos);
+	juce::FloatVectorOperations::copy(ring + m_writePos, src, n1);
+	juce::FloatVectorOperations::copy(ring, src + n1, numSamples - n1);
+
+	if (!m_fading)
+	{
+		render<Subtract, Accumulate>(m_tap, ring, src, dst, numSamples);
+		return;
+	}
+
+	// Render both sets of taps, blend them for as much of the chunk as the
+	// fade covers, then store or accumulate the result. The new taps have
+	// the last word, in case the fade finishes part way through.
+	int const numFade = juce::jmin(numSamples, m_fadeLength - m_fadePos);
+	SampleType * next = m_scratch.get();
+	SampleType * prev = next + getMaxChunkSize();
+	render<Subtract, false>(m_tap, ring, src, next, numSamples);
+	render<Subtract, false>(m_fadeFrom, ring, src, prev, numFade);
+
+	SampleType const * rampIn = m_ramps.get() + m_fadePos;
+	SampleType const * rampOut = rampIn + m_fadeLength;
+	juce::FloatVectorOperations::multiply(next, rampIn, numFade);
+	juce::FloatVectorOperations::addWithMultiply(next, prev, rampOut,
+			numFade);
+
+	if (Accumulate)
+		juce::FloatVectorOperations::add(dst, next, numSamples);
+	else
+		juce::FloatVectorOperations::copy(dst, next, numSamples);
+}
+
+template<typename SampleType>
+template<bool Subtract, bool Accumulate>
+void DelayEngine<SampleType>::render(Tap const & tap, SampleType const * ring,
+		SampleType const * src, SampleType * dst, int numSamples) const
+{
+	// Dry signal, straight from the input unless there's latency
+	int n1;
+	if (tap.latency == 0)
+	{
+		if (Accumulate)
+			juce::FloatVectorOperations::add(dst, src, numSamples);
+		else if (dst != src)
+			juce::FloatVectorOperations::copy(dst, src, numSamples);
+	}
+	else
+	{
+		int const dryPos = (m_writePos - tap.latency) & m_mask;
+		n1 = juce::jmin(numSamples, m_size - dryPos);
+		if (Accumulate)
+		{
+			juce::FloatVectorOperations::add(dst, ring + dryPos, n1);
+			juce::FloatVectorOperations::add(dst + n1, ring,
+					numSamples - n1);
+		}
+		else
+		{
+			juce::FloatVectorOperations::copy(dst, ring + dryPos, n1);
+			juce::FloatVectorOperations::copy(dst + n1, ring,
+					numSamples - n1);
+		}
+	}
+
+	// Fractional delays are a weighted sum of the neighbouring integer
+	// delays. Polarity just flips the weights.
+	if (tap.fraction != 0)
+	{
+		for (int k = 0; k <= tap.order; ++k)
+		{
+			addDelayed(ring, dst, tap.tapDelay + k,
+					Subtract ? -tap.taps[k] : tap.taps[k], numSamples);
+		}
+		return;
+	}
+
+	// Accumulate the delayed signal. As the newest input is already in the
+	// ring, a delay shorter than the block reads straight back out of it.
+	// Polarity is fixed at compile time, so this is a plain add/subtract
+	// rather than a multiply by +/-1.
+	int const readPos = (m_writePos - tap.delay) & m_mask;
+	n1 = juce::jmin(numSamples, m_size - readPos);
+	if (Subtract)
+	{
+		juce::FloatVectorOperations::subtract(dst, ring + readPos, n1);
+		juce::FloatVectorOperations::subtract(dst + n1, ring,
+				numSamples - n1);
+	}
+	else
+	{
+		juce::FloatVectorOperations::add(dst, ring + readPos, n1);
+		juce::FloatVectorOperations::add(dst + n1, ring, numSamples - n1);
+	}
+}
+
+template<typename SampleType>
+void DelayEngine<SampleType>::addDelayed(SampleType const * ring,
+		SampleType * dst, int delay, SampleType coeff, int numSamples) const
+{
+	int const readPos = (m_writePos - delay) & m_mask;
+	int const n1 = juce::jmin(numSamples, m_size - readPos);
+	juce::FloatVectorOperations::addWithMultiply(dst, ring + readPos, coeff,
+			n1);
+	juce::FloatVectorOperations::addWithMultiply(dst + n1, ring, coeff,
+			numSamples - n1);
+}
+
+template class DelayEngine<float>;
+template class DelayEngine<double>;
+
+template void DelayEngine<float>::process<false, false>(int, float const *,
+		float *, int);
+template void DelayEngine<float>::process<true, false>(int, float const *,
+		float *, int);
+template void DelayEngine<float>::process<false, true>(int, float const *,
+		float *, int);
+template void DelayEngine<float>::process<true, true>(int, float const *,
+		float *, int);
+template void DelayEngine<double>::process<false, false>(int,
+		double const *, double *, int);
+template void DelayEngine<double>::process<true, false>(int,
+		double const *, double *, int);
+template void DelayEngine<double>::process<false, true>(int,
+		double const *, double *, int);
+template void DelayEngine<double>::process<true, true>(int,
+		double const *, double *, int);
@@ -0,0 +1,229 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <JuceHeader.h>
+
+#include "BufferPool.h"
+
+// Multi-channel delay line operating on whole blocks of samples at a time.
+// Input is copied into a power-of-two sized ring buffer, and the delayed
+// signal is read back out of it in (at most two) contiguous runs, using
+// JUCE's vectorised FloatVectorOperations.
+//
+// Integer delays need no interpolation at all. Fractional delays use a
+// Lagrange interpolator, applied as scaled reads of the ring at neighbouring
+// integer delays, so they stay whole-block vector operations too. Third
+// order, i.e. four reads, is the default; higher orders are flatter towards
+// Nyquist, so cancel high frequencies more deeply, at proportionally more
+// cost.
+//
+// Output is the dry input plus or minus the delayed input. Negative delays
+// are done by delaying the dry signal instead, by a latency given by the
+// caller, so that several delay lines can be kept in line with each other.
+//
+// Changing the delay or latency crossfades from the old settings to the new
+// over a fixed number of samples, rather than jumping, so automating them
+// doesn't click. During a fade both are read and blended against a
+// precomputed ramp, again as whole-block vector operations; the rest of the
+// time only the one set of taps is read. Changes made during a fade take
+// effect once it has finished.
+//
+// All channels share a single write position. Callers should process every
+// channel for a given chunk of samples, then call advance() once.
+template<typename SampleType>
+class DelayEngine
+{
+	public:
+		DelayEngine() = default;
+
+		// Allocate & clear storage, with delay changes crossfaded over
+		// fadeLength samples, or applied immediately if zero. Not real-time
+		// safe; call from prepareToPlay.
+		void prepare(int numChannels, int maxDelay, int maxBlockSize,
+				int fadeLength = 0);
+
+		// Clear buffered history without reallocating, finishing any fade
+		// in progress
+		void reset();
+
+		// Clear one channel's history, leaving the others alone
+		void clearChannel(int channel);
+
+		// Return storage to the pool. Must be prepared again before use.
+		void release();
+
+		// Set delay in samples, plus a fraction of a sample in [0, 1), and
+		// the latency by which the dry signal is delayed. The delayed signal
+		// is read latency + delay + fraction samples back, so a negative
+		// delay needs a latency of at least -delay. Clamped to the range
+		// given to prepare.
+		void setDelay(int delay, SampleType fraction = 0, int latency = 0);
+
+		// Interpolator orders: the default, and the highest supported, for
+		// when CPU matters less than accuracy, e.g. offline rendering
+		static int constexpr standardOrder = 3;
+		static int constexpr highOrder = 15;
+
+		// Set the order of the fractional delay interpolator, from 1 to
+		// highOrder. Odd orders keep the fraction between the middle two
+		// taps. Changes are crossfaded like delay changes.
+		void setInterpolationOrder(int order);
+
+		int getInterpolationOrder() const
+		{
+			return m_order;
+		}
+
+		// Smallest latency allowing the given delay
+		static int getMinLatency(int delay)
+		{
+			return juce::jmax(0, -delay);
+		}
+
+		// Delay of the delayed signal, relative to the input, being faded
+		// to if a fade is in progress
+		int getDelay() const
+		{
+			return m_tap.delay;
+		}
+
+		int getLatency() const
+		{
+			return m_tap.latency;
+		}
+
+		SampleType getFraction() const
+		{
+			return m_tap.fraction;
+		}
+
+		// Number of samples after the input stops before output falls
+		// silent
+		int getTailLength() const
+		{
+			return m_fading ? juce::jmax(m_tap.getTailLength(),
+					m_fadeFrom.getTailLength()) : m_tap.getTailLength();
+		}
+
+		// Largest number of samples which may be passed to process() in one
+		// go without the write position overtaking the read position.
+		// Guaranteed to be at least the maxBlockSize passed to prepare, and
+		// zero if not prepared.
+		int getMaxChunkSize() const
+		{
+			return juce::jmax(0, m_size - m_maxDelay - highOrder);
+		}
+
+		// Write numSamples of src into the given channel's history, then
+		// store the dry signal into dst, or add it if Accumulate is set, and
+		// add the delayed signal, or subtract it if Subtract is set. src and
+		// dst may point to the same memory when not accumulating.
+		template<bool Subtract, bool Accumulate>
+		void process(int channel, SampleType const * src, SampleType * dst,
+				int numSamples);
+
+		// Move the shared write position on once all channels have been
+		// processed for the current chunk
+		void advance(int numSamples)
+		{
+			m_writePos = (m_writePos + numSamples) & m_mask;
+			m_running = true;
+			if (m_fading)
+			{
+				m_fadePos += numSamples;
+				if (m_fadePos >= m_fadeLength)
+					finishFade();
+			}
+		}
+
+	private:
+		JUCE_DECLARE_NON_COPYABLE (DelayEngine)
+
+		BufferPool::Block<SampleType> m_buffer;
+		int m_numChannels = 0;
+		int m_size = 0;
+		int m_mask = 0;
+		int m_writePos = 0;
+		int m_maxDelay = 0;
+		int m_order = standardOrder;
+
+		// Everything about where the dry & delayed signals are read from
+		struct Tap
+		{
+			int latency = 0;
+			int delay = 0;
+			// Fractional delays: the interpolator's taps are at integer
+			// delays tapDelay to tapDelay + order, with weights taps
+			SampleType fraction = 0;
+			int order = standardOrder;
+			int tapDelay = 0;
+			SampleType taps[highOrder + 1] = {};
+
+			int getTailLength() const
+			{
+				return juce::jmax(latency, fraction != 0
+						? tapDelay + order : delay);
+			}
+
+			bool sameAs(Tap const & other) const
+			{
+				return latency == other.latency && delay == other.delay
+					&& fraction == other.fraction
+					&& (fraction == 0 || order == other.order);
+			}
+		};
+
+		// Taps in use, most recently requested, and being faded from
+		Tap m_tap;
+		Tap m_target;
+		Tap m_fadeFrom;
+
+		// Crossfade state, ramps (gain for the new taps, then for the old),
+		// and somewhere to render each set of taps for blending. There's
+		// nothing to fade from until something has been processed since
+		// preparing or resetting.
+		bool m_running = false;
+		bool m_fading = false;
+		int m_fadeLength = 0;
+		int m_fadePos = 0;
+		BufferPool::Block<SampleType> m_ramps;
+		BufferPool::Block<SampleType> m_scratch;
+
+		Tap makeTap(int delay, SampleType fraction, int latency) const;
+
+		// Start fading to the requested taps, if they differ from the
+		// current ones, or switch straight to them if there's no call to
+		// fade
+		void startFade();
+		void finishFade();
+
+		// Store or accumulate one set of taps' output into dst
+		template<bool Subtract, bool Accumulate>
+		void render(Tap const & tap, SampleType const * ring,
+				SampleType const * src, SampleType * dst,
+				int numSamples) const;
+
+		// Add the signal delayed by an integer number of samples, scaled by
+		// coeff, into dst
+		void addDelayed(SampleType const * ring, SampleType * dst, int delay,
+				SampleType coeff, int numSamples) const;
+
+		SampleType * channelData(int channel)
+		{
+			return m_buffer.get() + static_cast<size_t>(channel) * m_size;
+		}
+};
@@ -0,0 +1,170 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#include "DelayEstimator.h"
+
+namespace
+{
+	// Weight given to each new frame's cross spectrum in the running average
+	float constexpr smoothing = 0.25f;
+}
+
+DelayEstimator::DelayEstimator() : juce::Thread("Delay estimator")
+{
+}
+
+DelayEstimator::~DelayEstimator()
+{
+	stop();
+}
+
+void DelayEstimator::start(int maxLag)
+{
+	stop();
+
+	// Frames are zero-padded to twice their length before transforming, so
+	// that lags of up to a whole frame don't wrap around
+	m_maxLag = maxLag;
+	m_frameSize = juce::nextPowerOfTwo(juce::jmax(1024, maxLag + 1));
+	int const fftSize = m_frameSize * 2;
+
+	m_fft.reset(new juce::dsp::FFT(juce::roundToInt(std::log2(fftSize))));
+	m_mainFrame.assign(static_cast<size_t>(m_frameSize), 0.0f);
+	m_sideFrame.assign(static_cast<size_t>(m_frameSize), 0.0f);
+	m_mainSpectrum.assign(static_cast<size_t>(fftSize) * 2, 0.0f);
+	m_sideSpectrum.assign(static_cast<size_t>(fftSize) * 2, 0.0f);
+	m_cross.assign(static_cast<size_t>(fftSize / 2 + 1), {});
+	m_crossValid = false;
+
+	// Safe to reallocate, as stop() made sure the producer is out of push()
+	m_fifo.prepare(m_frameSize * 4);
+
+	m_active.store(true, std::memory_order_release);
+	startThread();
+}
+
+void DelayEstimator::stop()
+{
+	m_active.store(false);
+	while (m_pushing.load())
+		std::this_thread::yield();
+
+	stopThread(1000);
+}
+
+DelayEstimator::Estimate DelayEstimator::getEstimate() const
+{
+	Estimate e;
+	e.sequence = m_sequence.load(std::memory_order_acquire);
+	e.lag = m_lag.load(std::memory_order_relaxed);
+	e.confidence = m_confidence.load(std::memory_order_relaxed);
+	return e;
+}
+
+void DelayEstimator::run()
+{
+	while (!threadShouldExit())
+	{
+		if (m_fifo.getNumReady() < m_frameSize)
+		{
+			wait(20);
+			continue;
+		}
+
+		m_fifo.pop(m_mainFrame.data(), m_sideFrame.data(), m_frameSize);
+		analyseFrame();
+	}
+}
+
+void DelayEstimator::analyseFrame()
+{
+	int const fftSize = m_fft->getSize();
+	int const numBins = fftSize / 2 + 1;
+
+	std::fill(m_mainSpectrum.begin(), m_mainSpectrum.end(), 0.0f);
+	std::fill(m_sideSpectrum.begin(), m_sideSpectrum.end(), 0.0f);
+	std::copy(m_mainFrame.begin(), m_mainFrame.end(),
+			m_mainSpectrum.begin());
+	std::copy(m_sideFrame.begin(), m_sideFrame.end(),
+			m_sideSpectrum.begin());
+
+	m_fft->performRealOnlyForwardTransform(m_mainSpectrum.data(), true);
+	m_fft->performRealOnlyForwardTransform(m_sideSpectrum.data(), true);
+
+	// Running average of main * conj(side)
+	for (int k = 0; k < numBins; ++k)
+	{
+		std::complex<float> x(m_mainSpectrum[2 * k],
+				m_mainSpectrum[2 * k + 1]);
+		std::complex<float> y(m_sideSpectrum[2 * k],
+				m_sideSpectrum[2 * k + 1]);
+		std::complex<float> g = x * std::conj(y);
+		if (m_crossValid)
+			m_cross[k] += smoothing * (g - m_cross[k]);
+		else
+			m_cross[k] = g;
+	}
+	m_crossValid = true;
+
+	// PHAT weighting: keep only phase, so the correlation peak is sharp
+	// regardless of the inputs' spectral balance. Fill in the full conjugate
+	// symmetric spectrum, reusing the main spectrum buffer, and transform
+	// back to get the correlation as a function of lag.
+	float * r = m_mainSpectrum.data();
+	for (int k = 0; k < numBins; ++k)
+	{
+		float const mag = std::abs(m_cross[k]);
+		std::complex<float> w = mag > 1e-20f
+			? m_cross[k] / mag : std::complex<float>();
+		r[2 * k] = w.real();
+		r[2 * k + 1] = w.imag();
+	}
+	for (int k = numBins; k < fftSize; ++k)
+	{
+		r[2 * k] = r[2 * (fftSize - k)];
+		r[2 * k + 1] = -r[2 * (fftSize - k) + 1];
+	}
+	m_fft->performRealOnlyInverseTransform(r);
+
+	// Find the strongest peak, of either polarity, within the lag range.
+	// Negative lags wrap around to the end of the buffer.
+	float best = 0;
+	int bestLag = 0;
+	double sum = 0;
+	for (int lag = -m_maxLag; lag <= m_maxLag; ++lag)
+	{
+		float const v = std::abs(r[lag >= 0 ? lag : fftSize + lag]);
+		sum += v;
+		if (v > best)
+		{
+			best = v;
+			bestLag = lag;
+		}
+	}
+
+	// Nothing but silence so far
+	if (best <= 0)
+		return;
+
+	double const mean = sum / (2 * m_maxLag + 1);
+	m_lag.store(bestLag, std::memory_order_relaxed);
+	m_confidence.store(static_cast<float>(best / mean),
+			std::memory_order_relaxed);
+	m_sequence.fetch_add(1, std::memory_order_release);
+}
@@ -0,0 +1,101 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <complex>
+#include <vector>
+
+#include <JuceHeader.h>
+
+#include "AnalysisFifo.h"
+
+// Background estimator for the offset between main & sidechain inputs, used
+// by the editor's "auto-align" mode to pick a delay instead of sweeping the
+// slider by ear.
+//
+// The audio thread pushes mono mixdowns of both inputs into a FIFO; a
+// background thread consumes them in frames, accumulates a smoothed cross
+// spectrum, and takes the peak of its PHAT-weighted inverse transform
+// (generalised cross-correlation with phase transform) as the estimate.
+class DelayEstimator : private juce::Thread
+{
+	public:
+		DelayEstimator();
+		~DelayEstimator() override;
+
+		// Start/stop estimation. Message thread only. Starting allocates.
+		void start(int maxLag);
+		void stop();
+
+		bool isActive() const
+		{
+			return m_active.load(std::memory_order_relaxed);
+		}
+
+		// Audio thread: feed input, before it is overwritten by processing.
+		// Does nothing unless estimation is active.
+		template<typename SampleType>
+		void push(SampleType const * const * main, int numMain,
+				SampleType const * const * side, int numSide, int numSamples)
+		{
+			if (!m_active.load(std::memory_order_relaxed))
+				return;
+
+			// Flag that we're inside push() so stop() can wait for us to
+			// leave before the FIFO is reallocated
+			m_pushing.store(true);
+			if (m_active.load())
+				m_fifo.push(main, numMain, side, numSide, numSamples);
+			m_pushing.store(false);
+		}
+
+		struct Estimate
+		{
+			// Lag in samples; positive when main lags behind sidechain
+			int lag;
+			// Ratio of correlation peak to mean correlation magnitude
+			float confidence;
+			// Incremented on each new estimate; 0 before the first
+			uint32_t sequence;
+		};
+
+		Estimate getEstimate() const;
+
+	private:
+		JUCE_DECLARE_NON_COPYABLE (DelayEstimator)
+
+		void run() override;
+		void analyseFrame();
+
+		AnalysisFifo m_fifo;
+		std::atomic<bool> m_active{false};
+		std::atomic<bool> m_pushing{false};
+
+		int m_maxLag = 0;
+		int m_frameSize = 0;
+		std::unique_ptr<juce::dsp::FFT> m_fft;
+		std::vector<float> m_mainFrame;
+		std::vector<float> m_sideFrame;
+		std::vector<float> m_mainSpectrum;
+		std::vector<float> m_sideSpectrum;
+		std::vector<std::complex<float>> m_cross;
+		bool m_crossValid = false;
+
+		std::atomic<int> m_lag{0};
+		std::atomic<float> m_confidence{0};
+		std::atomic<uint32_t> m_sequence{0};
+};
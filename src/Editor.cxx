@@ -13,68 +13,106 @@
 // You should have received a copy of the GNU General Public License along
 // with this program. If not, see <https://www.gnu.org/licenses/>.
 
+#include <cmath>
+
 #include "DebugLog.h"
+#include "DelayEstimator.h"
 #include "Editor.h"
+#include "InstanceManager.h"
+#include "ProcessMeter.h"
 #include "SuperSeparator.h"
 
+namespace
+{
+	// Minimum ratio of correlation peak to mean before auto-align trusts an
+	// estimate. Uncorrelated noise typically sits around 5.
+	float constexpr minAutoAlignConfidence = 10.0f;
+
+	char const * const autoAlignText = "Auto-align delay";
+}
+
 Editor::Editor(SuperSeparator * owner) : juce::AudioProcessorEditor(owner),
 	m_paramDelay(owner->getParamDelay()),
 	m_paramInvert(owner->getParamInvert()),
-	m_processorParamChangeBroadcaster(owner->getChangeBroadcaster()),
+	m_delayEstimator(owner->getDelayEstimator()),
+	m_processMeter(owner->getProcessMeter()),
 	m_backgroundColour(getLookAndFeel().findColour(
 				juce::ResizableWindow::backgroundColourId)),
 	m_invertToggle(this, "Invert main input"),
 	m_delaySlider(this, juce::Slider::LinearHorizontal,
-			juce::Slider::TextBoxRight)
+			juce::Slider::TextBoxRight),
+	m_autoAlignToggle(this, autoAlignText),
+	m_analyserView(*owner)
 {
 #ifdef SUPSEP_LOGGING
 	m_logname = owner->getLogName() + "-editor";
 	DebugLog::log(m_logname, "Constructing editor");
 #endif
 
-	// TODO Label that converts samples to milliseconds based on current sample
-	// rate. Will need a ChangeBroadcaster in the processor to update this.
-	// TODO Composite component for slider, slider label, and milliseconds.
+	// TODO Composite component for slider & slider label
 
-	// Set up logarithmic slider
-	m_delaySlider.setRange(0, m_paramDelay.getRange().getEnd(), 1);
-	m_delaySlider.setNumDecimalPlacesToDisplay(0);
-	m_delaySlider.setSkewFactor(0.2);
+	// Set up slider, with finer control around zero in both directions
+	auto const & range = m_paramDelay.getNormalisableRange();
+	m_delaySlider.setRange(range.start, range.end, range.interval);
+	m_delaySlider.setSkewFactor(range.skew, true);
+	m_delaySlider.setNumDecimalPlacesToDisplay(3);
+	m_delaySlider.setTextValueSuffix(" ms");
 
-	// Apply initial parameter values to widgets
+	// Apply initial parameter values to widgets, discarding any changes
+	// made before we existed
+	owner->takeChanges();
 	m_delaySlider.setValue(m_paramDelay.get(), juce::dontSendNotification);
 	m_invertToggle.setToggleState(m_paramInvert.getIndex(),
 			juce::dontSendNotification);
 
-	// Attach to processor's parameter change broadcaster to update GUI in
-	// response to automation/DAW-native UI parameter changes
-	owner->getChangeBroadcaster().addChangeListener(&m_pluginListener);
+	// Populate choice of leader, and keep it up to date as other instances
+	// come & go
+	updateLeaderCombo();
+	updateFollowerMode();
+	m_leaderCombo.addListener(&m_leaderComboListener);
+	InstanceManager::get()->addListener(&m_instancesListener);
 
 	// Lay out GUI
 
 	setResizable(false, false);
-	setSize(320, 120);
+	setSize(320, 460);
 
 	auto rect = getLocalBounds();
-	int height = rect.getHeight() / 2;
 	int constexpr margin = 10;
+	m_analyserView.setBounds(rect.removeFromBottom(160).reduced(margin));
+	int height = rect.getHeight() / 5;
 
+	m_leaderCombo.setBounds(rect.removeFromTop(height).reduced(margin));
 	m_invertToggle.setBounds(rect.removeFromTop(height).reduced(margin));
 	m_delaySlider.setBounds(rect.removeFromTop(height).reduced(margin));
+	m_autoAlignToggle.setBounds(rect.removeFromTop(height).reduced(margin));
+	m_meterLabel.setBounds(rect.removeFromTop(height).reduced(margin));
 
+	addAndMakeVisible(m_leaderCombo);
 	addAndMakeVisible(m_invertToggle);
 	addAndMakeVisible(m_delaySlider);
+	addAndMakeVisible(m_autoAlignToggle);
+	addAndMakeVisible(m_meterLabel);
+	addAndMakeVisible(m_analyserView);
+
+	m_meterPoller.timerCallback();
+	m_meterPoller.startTimerHz(4);
 }
 
 Editor::~Editor()
 {
-	auto ss = reinterpret_cast<SuperSeparator *>(&processor);
-
 #ifdef SUPSEP_LOGGING
 	DebugLog::log(m_logname, "Destroying editor");
 #endif
 
-	ss->getChangeBroadcaster().removeChangeListener(&m_pluginListener);
+	InstanceManager::get()->removeListener(&m_instancesListener);
+	m_leaderCombo.removeListener(&m_leaderComboListener);
+
+	// Auto-align is driven from the editor, so can't outlive it
+	m_autoAlignPoller.stopTimer();
+	m_delayEstimator.stop();
+
+	m_meterPoller.stopTimer();
 }
 
 void Editor::paint(juce::Graphics & g)
@@ -130,21 +168,233 @@ void Editor::DelaySlider::valueChanged()
 		(m_editor->m_paramDelay.convertTo0to1(static_cast<float>(getValue())));
 }
 
+template<typename... Args>
+Editor::AutoAlignToggle::AutoAlignToggle(Editor * editor, Args... args)
+	: juce::ToggleButton(args...), m_editor(editor)
+{
+}
+
+void Editor::AutoAlignToggle::clicked()
+{
+	if (getToggleState())
+	{
+		m_editor->m_autoAlignPoller.start();
+	}
+	else
+	{
+		m_editor->m_autoAlignPoller.stopTimer();
+		m_editor->m_delayEstimator.stop();
+		setButtonText(autoAlignText);
+	}
+}
+
+Editor::AutoAlignPoller::AutoAlignPoller(Editor * editor) : m_editor(editor)
+{
+}
+
+void Editor::AutoAlignPoller::start()
+{
+	// The estimator is started by the first callback
+	m_sampleRate = 0;
+	startTimerHz(10);
+	timerCallback();
+}
+
+void Editor::AutoAlignPoller::timerCallback()
+{
+	// How far the estimator looks depends on the sample rate, which isn't
+	// known until the processor has been prepared, and may change
+	double const rate = m_editor->processor.getSampleRate();
+	if (rate <= 0)
+		return;
+
+	auto & estimator = m_editor->m_delayEstimator;
+	auto & param = m_editor->m_paramDelay;
+	if (rate != m_sampleRate)
+	{
+		m_sampleRate = rate;
+		estimator.start(juce::jmax(1, static_cast<int>(
+						std::ceil(param.range.end * rate / 1000))));
+
+		// Ignore anything left over from a previous run
+		m_lastSequence = estimator.getEstimate().sequence;
+		return;
+	}
+
+	auto e = estimator.getEstimate();
+	if (e.sequence == m_lastSequence)
+		return;
+	m_lastSequence = e.sequence;
+
+	if (e.confidence < minAutoAlignConfidence)
+		return;
+
+	// Lag is in samples; the delay parameter is in ms. Say so rather than
+	// quietly ignoring an estimate we can't apply.
+	double const msPerSample = 1000 / rate;
+	float const delay = static_cast<float>(e.lag * msPerSample);
+	auto & toggle = m_editor->m_autoAlignToggle;
+	if (std::abs(delay) > param.range.end)
+	{
+		toggle.setButtonText(juce::String(autoAlignText) + " ("
+				+ juce::String(delay, 1) + " ms is out of range)");
+		return;
+	}
+	toggle.setButtonText(autoAlignText);
+
+	// Don't bother with changes of less than half a sample
+	if (std::abs(delay - param.get()) < msPerSample / 2)
+		return;
+
+	param.beginChangeGesture();
+	param.setValueNotifyingHost(param.convertTo0to1(delay));
+	param.endChangeGesture();
+}
+
+//
+// Instance linking
+//
+
+void Editor::updateLeaderCombo()
+{
+	auto ss = reinterpret_cast<SuperSeparator *>(&processor);
+	juce::Uuid const self = ss->getUuid();
+	juce::Uuid const leader = ss->getLeader();
+
+	m_leaderCombo.clear(juce::dontSendNotification);
+	m_leaderChoices.clear();
+	m_leaderCombo.addItem("Not following", 1);
+
+	// Name instances by the same short hash used in log files. Keep the
+	// current leader in the list even if it's gone away, as we'll pick it
+	// back up if it returns.
+	bool leaderListed = leader.isNull();
+	{
+		auto instances = InstanceManager::get()->instances();
+		for (auto const & e : instances->instances)
+		{
+			if (e.first == self)
+				continue;
+			leaderListed = leaderListed || e.first == leader;
+			m_leaderChoices.push_back(e.first);
+		}
+		for (auto const & uuid : instances->external)
+		{
+			leaderListed = leaderListed || uuid == leader;
+			m_leaderChoices.push_back(uuid);
+		}
+	}
+	if (!leaderListed)
+		m_leaderChoices.push_back(leader);
+
+	int selected = 1;
+	for (size_t i = 0; i < m_leaderChoices.size(); ++i)
+	{
+		juce::Uuid const & uuid = m_leaderChoices[i];
+		int const id = static_cast<int>(i) + 2;
+		juce::String name = "Follow "
+			+ juce::String::toHexString(uuid.hash());
+		if (!leaderListed && uuid == leader)
+			name += " (missing)";
+		m_leaderCombo.addItem(name, id);
+		if (uuid == leader)
+			selected = id;
+	}
+	m_leaderCombo.setSelectedId(selected, juce::dontSendNotification);
+}
+
+void Editor::updateFollowerMode()
+{
+	auto ss = reinterpret_cast<SuperSeparator *>(&processor);
+	bool const following = !ss->getLeader().isNull();
+	m_invertToggle.setEnabled(!following);
+	m_delaySlider.setEnabled(!following);
+	m_autoAlignToggle.setEnabled(!following);
+}
+
+Editor::LeaderComboListener::LeaderComboListener(Editor * editor)
+	: m_editor(editor)
+{
+}
+
+void Editor::LeaderComboListener::comboBoxChanged(juce::ComboBox *)
+{
+	auto ss = reinterpret_cast<SuperSeparator *>(&m_editor->processor);
+	int const i = m_editor->m_leaderCombo.getSelectedId() - 2;
+
+	juce::Uuid leader{juce::Uuid::null()};
+	if (i >= 0 && i < static_cast<int>(m_editor->m_leaderChoices.size()))
+		leader = m_editor->m_leaderChoices[static_cast<size_t>(i)];
+
+	// Turn off auto-align before following, as it would fight the leader
+	if (!leader.isNull() && m_editor->m_autoAlignToggle.getToggleState())
+		m_editor->m_autoAlignToggle.setToggleState(false,
+				juce::sendNotificationSync);
+
+	// If the link was refused, put the selection back how it was
+	if (!ss->setLeader(leader))
+		m_editor->updateLeaderCombo();
+	m_editor->updateFollowerMode();
+}
+
+//
+// CPU meter
+//
+
+Editor::MeterPoller::MeterPoller(Editor * editor) : m_editor(editor)
+{
+}
+
+void Editor::MeterPoller::timerCallback()
+{
+	auto stats = m_editor->m_processMeter.getStats();
+
+	juce::String text("CPU ");
+	if (stats.numBlocks == 0)
+	{
+		text += "-";
+	}
+	else
+	{
+		text += juce::String(stats.lastLoad * 100.0, 1) + "% (peak "
+			+ juce::String(stats.peakLoad * 100.0, 1) + "%), "
+			+ juce::String(stats.meanNsPerSample, 1) + " ns/sample";
+	}
+	m_editor->m_meterLabel.setText(text, juce::dontSendNotification);
+}
+
 //
 // External change listeners
 //
 
-Editor::ParentPluginChangeListener::ParentPluginChangeListener(
-		Editor * editor) : m_editor(editor)
+void Editor::pollChanges()
 {
+	auto ss = reinterpret_cast<SuperSeparator *>(&processor);
+	uint32_t const changes = ss->takeChanges();
+	if (changes == 0)
+		return;
+
+	auto const changed = [changes](juce::AudioProcessorParameter const & p)
+	{
+		return ((changes >> p.getParameterIndex()) & 1) != 0;
+	};
+
+	if ((changes >> SuperSeparator::linkChangedBit) & 1)
+		updateFollowerMode();
+	if (changed(m_paramDelay))
+		m_delaySlider.setValue(m_paramDelay.get(), juce::dontSendNotification);
+	if (changed(m_paramInvert))
+		m_invertToggle.setToggleState(m_paramInvert.getIndex(),
+				juce::dontSendNotification);
 }
 
-void Editor::ParentPluginChangeListener::changeListenerCallback(
-		juce::ChangeBroadcaster *)
+Editor::InstancesListener::InstancesListener(Editor * editor)
+	: m_editor(editor)
 {
-	// TODO If follower mode changed, toggle GUI controls enabled/disabled
-	m_editor->m_delaySlider.setValue(m_editor->m_paramDelay.get(),
-			juce::dontSendNotification);
-	m_editor->m_invertToggle.setToggleState(m_editor->m_paramInvert.getIndex(),
-			juce::dontSendNotification);
+}
+
+void Editor::InstancesListener::instancesChanged(
+		InstanceManager::Delta const &)
+{
+	m_editor->updateLeaderCombo();
 }
@@ -15,8 +15,15 @@
 
 #pragma once
 
+#include <vector>
+
 #include <JuceHeader.h>
 
+#include "AnalyserView.h"
+#include "InstanceManager.h"
+
+class DelayEstimator;
+class ProcessMeter;
 class SuperSeparator;
 
 // Class for the plugin's editor GUI
@@ -41,12 +48,14 @@ class Editor : public juce::AudioProcessorEditor
 		using juce::AudioProcessorEditor::resizableCorner;
 
 		// References to audio processor's parameters
-		juce::AudioParameterInt & m_paramDelay;
+		juce::AudioParameterFloat & m_paramDelay;
 		juce::AudioParameterChoice & m_paramInvert;
 
-		// And the change broadcaster on which it will broadcast when there's
-		// been a parameter change via automation/DAW-native UI
-		juce::ChangeBroadcaster & m_processorParamChangeBroadcaster;
+		// Background delay estimator used in auto-align mode
+		DelayEstimator & m_delayEstimator;
+
+		// Processing callback CPU usage statistics
+		ProcessMeter const & m_processMeter;
 
 		juce::Colour m_backgroundColour;
 
@@ -79,42 +88,120 @@ class Editor : public juce::AudioProcessorEditor
 				Editor * m_editor;
 		};
 
+		class AutoAlignToggle : public juce::ToggleButton
+		{
+			public:
+				template<typename... Args>
+				AutoAlignToggle(Editor * editor, Args... args);
+
+			private:
+				Editor * m_editor;
+				void clicked() override;
+		};
+
 		InvertToggle m_invertToggle;
 		DelaySlider m_delaySlider;
+		AutoAlignToggle m_autoAlignToggle;
+
+		//
+		// Instance linking
+		//
+
+		// Choice of another instance to follow. Item 1 is "not following";
+		// the rest correspond to entries in m_leaderChoices.
+		juce::ComboBox m_leaderCombo;
+		std::vector<juce::Uuid> m_leaderChoices;
+
+		// Repopulate the leader combo box from the instance manager
+		void updateLeaderCombo();
+
+		// Enable/disable parameter controls according to follower mode
+		void updateFollowerMode();
+
+		class LeaderComboListener : public juce::ComboBox::Listener
+		{
+			public:
+				LeaderComboListener(Editor * editor);
+				void comboBoxChanged(juce::ComboBox *) override;
+
+			private:
+				Editor * m_editor;
+		};
+
+		LeaderComboListener m_leaderComboListener{this};
+
+		// Applies the delay estimator's latest result to the delay parameter
+		// whilst auto-align is switched on
+		class AutoAlignPoller : public juce::Timer
+		{
+			public:
+				AutoAlignPoller(Editor * editor);
+				void start();
+				void timerCallback() override;
+
+			private:
+				Editor * m_editor;
+				uint32_t m_lastSequence = 0;
+				// Rate the estimator was started at, or 0 if not yet
+				double m_sampleRate = 0;
+		};
+
+		AutoAlignPoller m_autoAlignPoller{this};
+
+		//
+		// CPU meter
+		//
+
+		juce::Label m_meterLabel;
+
+		// Refreshes the CPU meter readout from the processor's statistics
+		class MeterPoller : public juce::Timer
+		{
+			public:
+				MeterPoller(Editor * editor);
+				void timerCallback() override;
+
+			private:
+				Editor * m_editor;
+		};
+
+		MeterPoller m_meterPoller{this};
+
+		//
+		// Analysis
+		//
+
+		AnalyserView m_analyserView;
 
 		//
 		// External change listeners
 		//
 
-		// Listener for parameter changes coming from our parent
-		// AudioProcessor instance, e.g. from parameter automation during
-		// playback or host-native GUI controls
-		class ParentPluginChangeListener : public juce::ChangeListener
+		// Pick up changes made by our parent AudioProcessor instance, e.g.
+		// from parameter automation during playback or host-native GUI
+		// controls. Polled once per display frame, so however dense the
+		// automation, widgets update at most once per frame.
+		void pollChanges();
+
+		juce::VBlankAttachment m_vblankAttachment{this,
+			[this] { pollChanges(); }};
+
+		// Listener for plugin instances coming & going, to keep the choice
+		// of leaders up to date
+		class InstancesListener : public InstanceManager::Listener
 		{
 			public:
-				ParentPluginChangeListener(Editor * editor);
-				void changeListenerCallback(juce::ChangeBroadcaster *)
+				InstancesListener(Editor * editor);
+				void instancesChanged(InstanceManager::Delta const &)
 					override;
 
 			private:
 				Editor * m_editor;
 		};
 
-		ParentPluginChangeListener m_pluginListener{this};
-
-		// TODO ChangeListeners for:
-		// - Remote's ChangeBroadcaster (parameter changes when in follower
-		//   mode)
-		// - InstanceManager's ChangeBroadcaster (changes to/from follower
-		//   mode; plugin instances registered/unregistered)
-		// - Or should the concept of a Remote be mostly abstracted away
-		//   within the SuperSeparator class itself, and the Editor always
-		//   listens to the parent plugin's change broadcaster?
-		//   - Probably cleaner
-		//   - Have the plugin expose a "follower mode" toggle, and use that to
-		//     decide in the Editor when to enable/disable the GUI controls
-		//   - Have the SuperSeparator expose methods for getting/setting
-		//     parameter values, instead of just direct references to the JUCE
-		//     parameters, and abstract away the toggle between local & remote
-		//     values
+		InstancesListener m_instancesListener{this};
+
+		// TODO Whilst following, show the leader's values in the parameter
+		// controls rather than our own (currently they're just disabled).
+		// Would need the Remote to notify on leader parameter changes.
 };
@@ -13,12 +13,116 @@
 // You should have received a copy of the GNU General Public License along
 // with this program. If not, see <https://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <thread>
+
 #include "DebugLog.h"
 #include "InstanceManager.h"
 #include "Remote.h"
 
 InstanceManager InstanceManager::m_singleton;
 
+namespace
+{
+	bool uuidLess(std::pair<juce::Uuid, Remote *> const & a,
+			juce::Uuid const & b)
+	{
+		return a.first < b;
+	}
+
+	// How often to check the SharedRegistry for changes made by other
+	// processes, and refresh the heartbeats of our own slots
+	int constexpr sharedPollMs = 500;
+
+	// Whether an instance in another process is registered with the given
+	// UUID
+	bool registeredElsewhere(juce::Uuid const & uuid)
+	{
+		for (auto const & e : SharedRegistry::get()->list())
+		{
+			if (!e.local && e.uuid == uuid)
+				return true;
+		}
+		return false;
+	}
+
+	// Add uuid to one side of a delta, unless it's pending on the other
+	// side, in which case the two changes cancel out
+	void addToDelta(std::vector<juce::Uuid> & to,
+			std::vector<juce::Uuid> & cancels, juce::Uuid const & uuid)
+	{
+		auto i = std::find(cancels.begin(), cancels.end(), uuid);
+		if (i != cancels.end())
+			cancels.erase(i);
+		else
+			to.push_back(uuid);
+	}
+}
+
+InstanceManager::InstanceManager() : m_current(new Snapshot)
+{
+}
+
+InstanceManager::~InstanceManager()
+{
+	delete m_current.load();
+}
+
+//
+// Snapshots
+//
+
+Remote * InstanceManager::Snapshot::find(juce::Uuid const & uuid) const
+{
+	auto i = std::lower_bound(instances.begin(), instances.end(), uuid,
+			uuidLess);
+	if (i != instances.end() && i->first == uuid)
+		return i->second;
+	return nullptr;
+}
+
+InstanceManager::ReadGuard::ReadGuard(InstanceManager & manager)
+	: m_manager(manager)
+{
+	// Register as a reader in the current epoch. If a writer flipped the
+	// epoch in the meantime, it may already have checked our counter, so
+	// back out & try again in the new one.
+	for (;;)
+	{
+		uint32_t const epoch = m_manager.m_epoch.load();
+		m_slot = static_cast<int>(epoch & 1);
+		m_manager.m_readers[m_slot].fetch_add(1);
+		if (m_manager.m_epoch.load() == epoch)
+			break;
+		m_manager.m_readers[m_slot].fetch_sub(1);
+	}
+
+	m_snapshot = m_manager.m_current.load();
+}
+
+InstanceManager::ReadGuard::~ReadGuard()
+{
+	m_manager.m_readers[m_slot].fetch_sub(1);
+}
+
+void InstanceManager::publish(std::unique_ptr<Snapshot> next)
+{
+	next->generation = m_current.load()->generation + 1;
+	Snapshot const * old = m_current.exchange(next.release());
+
+	// Anyone registering as a reader from here on will see the new
+	// snapshot. Wait for everyone who registered before to finish.
+	uint32_t const epoch = m_epoch.fetch_add(1);
+	while (m_readers[epoch & 1].load() != 0)
+		std::this_thread::yield();
+
+	delete old;
+}
+
+//
+// Registration
+//
+
 bool InstanceManager::registerInstance(juce::Uuid const & name,
 		Remote * remote)
 {
@@ -27,17 +131,54 @@ bool InstanceManager::registerInstance(juce::Uuid const & name,
 			+ name.toDashedString());
 #endif
 	auto l = lock();
-	auto i = m_instances.find(name);
-	if (i == m_instances.end())
+	Snapshot const & current = *m_current.load();
+	Remote * existing = current.find(name);
+	if (existing == nullptr && SharedRegistry::get()->open()
+			&& registeredElsewhere(name))
+	{
+		// Same as below, but the other copy is in another process
+#ifdef SUPSEP_LOGGING
+		DebugLog::log("im",
+				"Warning: duplicate UUID in another process");
+#endif
+		return false;
+	}
+
+	if (existing == nullptr)
 	{
-		m_instances.emplace(name, remote);
-		m_instancesChanged.addChangeListener(remote->getInstancesListener());
-		m_instancesChanged.sendChangeMessage();
-		// TODO Look up pending "take ownership of" requests, and if there is
-		// another instance waiting to take ownership of this one, provide it
-		// with the Remote's pointer
+		std::unique_ptr<Snapshot> next{new Snapshot(current)};
+		auto i = std::lower_bound(next->instances.begin(),
+				next->instances.end(), name, uuidLess);
+		next->instances.emplace(i, name, remote);
+		publish(std::move(next));
+
+		m_listeners.add(remote->getInstancesListener());
+		addToDelta(m_pendingDelta.added, m_pendingDelta.removed, name);
+		triggerAsyncUpdate();
+
+		// Complete links from any followers that were waiting for this
+		// instance to turn up, and from this instance to its own leader if
+		// that's already here. Followers can't be followed, so if both were
+		// restored from a session, the instance's own link wins.
+		Snapshot const & now = *m_current.load();
+		for (auto const & e : now.instances)
+		{
+			if (e.second->m_leaderUuid == name
+					&& remote->m_leaderUuid.isNull())
+				e.second->m_leader.store(remote, std::memory_order_release);
+		}
+		if (!remote->m_leaderUuid.isNull())
+		{
+			remote->m_leader.store(now.find(remote->m_leaderUuid),
+					std::memory_order_release);
+		}
+
+		claimShared(name, remote);
+		refreshShared();
+		if (!isTimerRunning())
+			startTimer(sharedPollMs);
 	}
-	else if (i->second != remote)
+	else if (existing != remote)
 	{
 		// In an ideal world this wouldn't happen, but if the user is doing
 		// something like a plugin copy & paste, it's feasible that the host
@@ -54,7 +195,7 @@ bool InstanceManager::registerInstance(juce::Uuid const & name,
 		return false;
 	}
 #ifdef SUPSEP_LOGGING
-	else if (i->second == remote)
+	else
 	{
 		// This shouldn't happen.
 		DebugLog::log("im", "Error: duplicate instance");
@@ -70,16 +211,42 @@ void InstanceManager::unregisterInstance(juce::Uuid const & name,
 	DebugLog::log("im", juce::String("Unregistering instance ")
 			+ name.toDashedString());
 #endif
+	juce::ignoreUnused(remote);
+
 	auto l = lock();
-	auto i = m_instances.find(name);
-	if (i != m_instances.end())
+	Snapshot const & current = *m_current.load();
+	Remote * existing = current.find(name);
+	if (existing != nullptr)
 	{
-		m_instancesChanged.removeChangeListener(
-				i->second->getInstancesListener());
-		m_instances.erase(i);
-		m_instancesChanged.sendChangeMessage();
-		// TODO Look up whether this instance has a leader, and if so, null out
-		// its Remote pointer
+		m_listeners.remove(existing->getInstancesListener());
+
+		// Cut followers loose. They keep the leader's UUID, so they'll pick
+		// it up again if it comes back (e.g. after a UUID change).
+		for (auto const & e : current.instances)
+		{
+			if (e.second->m_leader.load() == existing)
+				e.second->m_leader.store(nullptr, std::memory_order_release);
+		}
+		existing->m_leader.store(nullptr, std::memory_order_release);
+		existing->m_sharedLeader.store(0, std::memory_order_release);
+
+		// Followers in other processes see the slot's claim go away
+		SharedRegistry::get()->release(SharedRegistry::Handle::unpack(
+					existing->m_shared.load()));
+		existing->m_shared.store(0);
+
+		std::unique_ptr<Snapshot> next{new Snapshot(current)};
+		next->instances.erase(std::lower_bound(next->instances.begin(),
+					next->instances.end(), name, uuidLess));
+		if (next->instances.empty())
+			stopTimer();
+
+		// Only returns once no reader can still see the Remote, either in
+		// the snapshot or through a follower's leader pointer, so the caller
+		// is free to destroy it
+		publish(std::move(next));
+		addToDelta(m_pendingDelta.removed, m_pendingDelta.added, name);
+		triggerAsyncUpdate();
 	}
 #ifdef SUPSEP_LOGGING
 	else
@@ -89,8 +256,199 @@ void InstanceManager::unregisterInstance(juce::Uuid const & name,
 #endif
 }
 
-std::map<juce::Uuid, Remote *> InstanceManager::instances()
+//
+// Linking
+//
+
+bool InstanceManager::link(juce::Uuid const & followerUuid, Remote * follower,
+		juce::Uuid const & leaderUuid)
+{
+#ifdef SUPSEP_LOGGING
+	DebugLog::log("im", followerUuid.toDashedString() + " following "
+			+ leaderUuid.toDashedString());
+#endif
+	auto l = lock();
+	Snapshot const & current = *m_current.load();
+	Remote * leader = nullptr;
+
+	if (!leaderUuid.isNull())
+	{
+		if (leaderUuid == followerUuid)
+			return false;
+
+		leader = current.find(leaderUuid);
+		if (leader != nullptr && !leader->m_leaderUuid.isNull())
+			return false;
+
+		for (auto const & e : current.instances)
+		{
+			if (e.second->m_leaderUuid == followerUuid)
+				return false;
+		}
+
+		// Same again for instances in other processes
+		for (auto const & e : SharedRegistry::get()->list())
+		{
+			if (e.local)
+				continue;
+			if (e.uuid == leaderUuid && !e.leader.isNull())
+				return false;
+			if (e.leader == followerUuid)
+				return false;
+		}
+	}
+
+	follower->m_leaderUuid = leaderUuid;
+	follower->m_leader.store(leader, std::memory_order_release);
+	SharedRegistry::get()->setLeader(SharedRegistry::Handle::unpack(
+				follower->m_shared.load()), leaderUuid);
+	refreshShared();
+	return true;
+}
+
+//
+// Instances in other processes
+//
+
+void InstanceManager::claimShared(juce::Uuid const & uuid, Remote * remote)
+{
+	SharedRegistry & shared = *SharedRegistry::get();
+	if (!shared.open())
+		return;
+
+	auto const handle = shared.claim(uuid, remote->m_leaderUuid,
+			remote->m_published.load());
+	remote->m_shared.store(handle.pack());
+	if (!handle.isValid())
+		return;
+
+	// A parameter change racing with the claim may have been published
+	// before the slot was ready; copy until the value stops changing
+	for (uint64_t v = remote->m_published.load();;)
+	{
+		shared.publish(handle, v);
+		uint64_t const latest = remote->m_published.load();
+		if (latest == v)
+			break;
+		v = latest;
+	}
+}
+
+void InstanceManager::refreshShared()
+{
+	SharedRegistry & shared = *SharedRegistry::get();
+	if (!shared.open())
+		return;
+
+	// Note the generation first, so changes made while listing are picked
+	// up next time round
+	m_sharedGeneration = shared.getGeneration();
+	auto const entries = shared.list();
+
+	std::vector<juce::Uuid> external;
+	for (auto const & e : entries)
+	{
+		if (!e.local)
+			external.push_back(e.uuid);
+	}
+
+	// Followers whose leader isn't in this process read it from the
+	// registry instead. In-process leaders always take precedence.
+	Snapshot const & current = *m_current.load();
+	for (auto const & i : current.instances)
+	{
+		Remote * remote = i.second;
+		uint64_t handle = 0;
+		if (!remote->m_leaderUuid.isNull()
+				&& remote->m_leader.load() == nullptr)
+		{
+			for (auto const & e : entries)
+			{
+				if (!e.local && e.uuid == remote->m_leaderUuid)
+				{
+					handle = e.handle.pack();
+					break;
+				}
+			}
+		}
+		remote->m_sharedLeader.store(handle, std::memory_order_release);
+	}
+
+	if (external == current.external)
+		return;
+
+	for (auto const & uuid : external)
+	{
+		if (!std::binary_search(current.external.begin(),
+					current.external.end(), uuid))
+			addToDelta(m_pendingDelta.added, m_pendingDelta.removed, uuid);
+	}
+	for (auto const & uuid : current.external)
+	{
+		if (!std::binary_search(external.begin(), external.end(), uuid))
+			addToDelta(m_pendingDelta.removed, m_pendingDelta.added, uuid);
+	}
+
+	std::unique_ptr<Snapshot> next{new Snapshot(current)};
+	next->external = std::move(external);
+	publish(std::move(next));
+	triggerAsyncUpdate();
+}
+
+void InstanceManager::timerCallback()
+{
+	auto l = lock();
+	SharedRegistry & shared = *SharedRegistry::get();
+
+	// Keep our slots alive. Slots can be lost if we go quiet for long
+	// enough that other processes think we've crashed; instances without
+	// one, for that reason or because the registry was full, try again.
+	for (auto const & i : m_current.load()->instances)
+	{
+		auto const handle = SharedRegistry::Handle::unpack(
+				i.second->m_shared.load());
+		if (!handle.isValid() || !shared.heartbeat(handle))
+			claimShared(i.first, i.second);
+	}
+
+	if (shared.getGeneration() != m_sharedGeneration)
+		refreshShared();
+}
+
+//
+// Notifications
+//
+
+void InstanceManager::addListener(Listener * listener)
+{
+	auto l = lock();
+	m_listeners.add(listener);
+}
+
+void InstanceManager::removeListener(Listener * listener)
 {
 	auto l = lock();
-	return m_instances;
+	m_listeners.remove(listener);
+}
+
+void InstanceManager::handleAsyncUpdate()
+{
+	Delta delta;
+	{
+		auto l = lock();
+		std::swap(delta, m_pendingDelta);
+		delta.generation = m_current.load()->generation;
+	}
+
+	if (delta.added.empty() && delta.removed.empty())
+		return;
+
+#ifdef SUPSEP_LOGGING
+	DebugLog::logValue("im", "Instances added:",
+			static_cast<juce::int64>(delta.added.size()));
+	DebugLog::logValue("im", "Instances removed:",
+			static_cast<juce::int64>(delta.removed.size()));
+#endif
+
+	m_listeners.call([&delta](Listener & l) { l.instancesChanged(delta); });
 }
@@ -15,11 +15,16 @@
 
 #pragma once
 
-#include <map>
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <utility>
+#include <vector>
 
 #include <JuceHeader.h>
 
+#include "SharedRegistry.h"
+
 // Forward declaration of interface class used by a leader plugin to affect
 // parameter changes on a follower
 class Remote;
@@ -29,7 +34,20 @@ class Remote;
 // that the platforms we're interested in will load only one instance of a
 // shared library into a given process, so should work fine in any DAW that
 // doesn't sandbox each plugin instance into its own sub-process.
-class InstanceManager
+//
+// For DAWs that do, every instance is also entered into the SharedRegistry,
+// which is polled from the message thread for instances in other processes.
+// Those appear in snapshots by UUID only, and can be followed through their
+// registry slots rather than through their Remotes.
+//
+// The registry itself is published as a series of immutable snapshots, RCU
+// style. Readers never lock or copy: they pin whichever snapshot is current
+// for as long as they hold a ReadGuard. Writers are serialised by the
+// manager lock, publish a new snapshot, then wait for any readers still
+// pinning the old one before freeing it. This means a Remote found through a
+// ReadGuard stays valid until the guard is released, as unregistering only
+// returns once no reader can still see it.
+class InstanceManager : private juce::AsyncUpdater, private juce::Timer
 {
 	public:
 		InstanceManager(InstanceManager const &) = delete;
@@ -43,13 +61,78 @@ class InstanceManager
 			return &m_singleton;
 		}
 
-		// Grab a copy of the current list of known plugin instances
+		// Immutable list of registered instances, sorted by UUID
+		struct Snapshot
+		{
+			// Incremented every time the registry changes
+			uint64_t generation = 0;
+			std::vector<std::pair<juce::Uuid, Remote *>> instances;
+			// Instances in other processes, sorted
+			std::vector<juce::Uuid> external;
+
+			Remote * find(juce::Uuid const & uuid) const;
+		};
+
+		// Pins the current snapshot for the guard's lifetime. Lock-free &
+		// allocation-free, so usable from the audio thread. Keep guards
+		// short-lived, and never register or unregister an instance while
+		// holding one - the writer would wait on its own guard forever.
+		class ReadGuard
+		{
+			public:
+				ReadGuard(InstanceManager & manager);
+				~ReadGuard();
+
+				ReadGuard(ReadGuard const &) = delete;
+				ReadGuard & operator=(ReadGuard const &) = delete;
+
+				Snapshot const & operator*() const
+				{
+					return *m_snapshot;
+				}
+
+				Snapshot const * operator->() const
+				{
+					return m_snapshot;
+				}
+
+			private:
+				InstanceManager & m_manager;
+				Snapshot const * m_snapshot;
+				int m_slot;
+		};
+
+		// Get read access to the current list of known plugin instances
 		// TODO This will primarily be used to render the UI - to ensure there
 		// are no gnarly race conditions between instances coming/going,
 		// notifications reaching editors, and editors updating their combo
 		// boxes, this should return a list of labels & enabled/disabled states
 		// directly, not pointers to Remotes
-		std::map<juce::Uuid, Remote *> instances();
+		ReadGuard instances()
+		{
+			return ReadGuard(*this);
+		}
+
+		// Changes to the registry since the previous notification
+		struct Delta
+		{
+			// Generation of the snapshot current when the delta was sent
+			uint64_t generation = 0;
+			std::vector<juce::Uuid> added;
+			std::vector<juce::Uuid> removed;
+		};
+
+		// Listeners are notified on the message thread, at most once per
+		// message loop iteration, with all registrations & unregistrations
+		// since the last notification coalesced into a single delta. An
+		// instance registered & unregistered again in between doesn't
+		// appear at all.
+		class Listener
+		{
+			public:
+				virtual ~Listener() = default;
+				virtual void instancesChanged(Delta const & delta) = 0;
+		};
 
 		// Plugin instances should register/unregister themselves upon
 		// creation. Registration may fail if two instances exist with the same
@@ -58,19 +141,24 @@ class InstanceManager
 		bool registerInstance(juce::Uuid const & uuid, Remote * remote);
 		void unregisterInstance(juce::Uuid const & uuid, Remote * remote);
 
-		// I don't know for certain that some VST hosts don't have multiple
-		// GUI and audio threads, so all communication between instances should
-		// be done with the manager lock held (shouldn't be a performance
-		// problem as it's really not intended to have its parameters tweaked
-		// except when scanning for good delay values).
-		// To that end, we need:
-		// - a scoped instance manager lock guard (and method for creating one)
-		// - the instance manager to (with lock held) null out the follower
-		//   pointer in the leader when an instance with leader unregisters
-		// - leaders to check (with lock held) validity of follower pointer
-		//   before calling any methods on it, so we don't crash if another
-		//   thread destroys a follower during manipulation
-		// - the processor destructor to take the manager lock
+		// Message thread: register/unregister for batched notifications of
+		// registry changes
+		void addListener(Listener * listener);
+		void removeListener(Listener * listener);
+
+		// Make follower follow the instance with the given UUID, or stop
+		// following if it's null. The leader doesn't have to be registered
+		// yet; the link is completed when it is (e.g. when a session
+		// restores followers before their leader). Fails if the leader is
+		// itself a follower, or if anyone is following the follower, so
+		// chains & cycles can't form.
+		bool link(juce::Uuid const & followerUuid, Remote * follower,
+				juce::Uuid const & leaderUuid);
+
+		// Changes to the registry, and to links between instances, are
+		// serialised by the manager lock. Reading doesn't need it; see
+		// ReadGuard. A follower's pointer to its leader is nulled out, with
+		// the lock held, before the leader's unregistration completes.
 
 		[[nodiscard]] std::unique_lock<std::mutex> lock()
 		{
@@ -78,13 +166,42 @@ class InstanceManager
 		}
 
 	private:
-		InstanceManager() = default;
-		~InstanceManager() = default;
+		InstanceManager();
+		~InstanceManager();
 
 		static InstanceManager m_singleton;
 
-		std::map<juce::Uuid, Remote *> m_instances;
+		void handleAsyncUpdate() override;
+
+		// Keep our SharedRegistry slots alive, and pick up changes made by
+		// other processes
+		void timerCallback() override;
+
+		// Claim a registry slot for a local instance, and make sure it
+		// holds the instance's current values. Manager lock must be held.
+		void claimShared(juce::Uuid const & uuid, Remote * remote);
+
+		// Bring the list of instances in other processes, and followers'
+		// links to leaders in other processes, up to date with the
+		// registry. Manager lock must be held.
+		void refreshShared();
+		uint32_t m_sharedGeneration = 0;
+
+		// Replace the current snapshot & reclaim the old one once no reader
+		// can still be using it. Manager lock must be held.
+		void publish(std::unique_ptr<Snapshot> next);
+
+		std::atomic<Snapshot const *> m_current;
+
+		// Readers register in the counter for the current epoch. Publishing
+		// flips the epoch, so new readers use the other counter, then waits
+		// for the old one to drain.
+		std::atomic<uint32_t> m_epoch{0};
+		std::atomic<int> m_readers[2] = {{0}, {0}};
+
 		std::mutex m_mutex;
 
-		juce::ChangeBroadcaster m_instancesChanged;
+		// Accumulated under the manager lock, sent by handleAsyncUpdate
+		Delta m_pendingDelta;
+		juce::ListenerList<Listener> m_listeners;
 };
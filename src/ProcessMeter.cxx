@@ -0,0 +1,117 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "ProcessMeter.h"
+
+void ProcessMeter::prepare(double sampleRate,
+		int maximumExpectedSamplesPerBlock)
+{
+	m_sampleRate = sampleRate;
+	m_budgetNs = maximumExpectedSamplesPerBlock * 1e9 / sampleRate;
+	reset();
+}
+
+void ProcessMeter::reset()
+{
+	m_numBlocks.store(0, std::memory_order_relaxed);
+	m_totalSamples.store(0, std::memory_order_relaxed);
+	m_totalTicks.store(0, std::memory_order_relaxed);
+	m_lastBlockTicks.store(0, std::memory_order_relaxed);
+	m_lastLoad.store(0, std::memory_order_relaxed);
+	m_peakBlockTicks.store(0, std::memory_order_relaxed);
+	m_peakLoad.store(0, std::memory_order_relaxed);
+
+	for (auto & b : m_blockBuckets)
+		b.store(0, std::memory_order_relaxed);
+	for (auto & b : m_sampleBuckets)
+		b.store(0, std::memory_order_relaxed);
+}
+
+int ProcessMeter::bucketFor(double ticks)
+{
+	if (ticks < 2.0)
+		return 0;
+
+	int exponent;
+	std::frexp(ticks, &exponent);
+	return juce::jmin(numBuckets - 1, exponent - 1);
+}
+
+void ProcessMeter::record(uint64_t ticks, int numSamples)
+{
+	if (numSamples <= 0 || m_sampleRate <= 0)
+		return;
+
+	double const t = static_cast<double>(ticks);
+	double const ticksPerSample = t / numSamples;
+	double const load = ticksPerSample * m_sampleRate;
+
+	// There is only ever one audio thread calling us at a time, so plain
+	// loads & stores are enough to update running totals & peaks
+	m_totalTicks.store(m_totalTicks.load(std::memory_order_relaxed) + t,
+			std::memory_order_relaxed);
+	m_totalSamples.fetch_add(static_cast<uint64_t>(numSamples),
+			std::memory_order_relaxed);
+	m_lastBlockTicks.store(t, std::memory_order_relaxed);
+	m_lastLoad.store(load, std::memory_order_relaxed);
+	if (t > m_peakBlockTicks.load(std::memory_order_relaxed))
+		m_peakBlockTicks.store(t, std::memory_order_relaxed);
+	if (load > m_peakLoad.load(std::memory_order_relaxed))
+		m_peakLoad.store(load, std::memory_order_relaxed);
+
+	m_blockBuckets[static_cast<size_t>(bucketFor(t))].fetch_add(1,
+			std::memory_order_relaxed);
+	m_sampleBuckets[static_cast<size_t>(bucketFor(ticksPerSample))]
+		.fetch_add(1, std::memory_order_relaxed);
+
+	// Published last, so a reader seeing a new block count sees the rest
+	m_numBlocks.fetch_add(1, std::memory_order_release);
+}
+
+ProcessMeter::Stats ProcessMeter::getStats() const
+{
+	double const tickNs = nsPerTick();
+
+	Stats s;
+	s.numBlocks = m_numBlocks.load(std::memory_order_acquire);
+	s.budgetNs = m_budgetNs;
+	s.lastBlockNs = m_lastBlockTicks.load(std::memory_order_relaxed) * tickNs;
+	s.lastLoad = m_lastLoad.load(std::memory_order_relaxed) * tickNs / 1e9;
+	s.peakBlockNs = m_peakBlockTicks.load(std::memory_order_relaxed) * tickNs;
+	s.peakLoad = m_peakLoad.load(std::memory_order_relaxed) * tickNs / 1e9;
+
+	uint64_t const samples = m_totalSamples.load(std::memory_order_relaxed);
+	s.meanNsPerSample = samples > 0
+		? m_totalTicks.load(std::memory_order_relaxed) * tickNs / samples : 0.0;
+	return s;
+}
+
+std::array<uint64_t, ProcessMeter::numBuckets>
+ProcessMeter::getBlockHistogram() const
+{
+	std::array<uint64_t, numBuckets> h;
+	for (size_t i = 0; i < h.size(); ++i)
+		h[i] = m_blockBuckets[i].load(std::memory_order_relaxed);
+	return h;
+}
+
+std::array<uint64_t, ProcessMeter::numBuckets>
+ProcessMeter::getSampleHistogram() const
+{
+	std::array<uint64_t, numBuckets> h;
+	for (size_t i = 0; i < h.size(); ++i)
+		h[i] = m_sampleBuckets[i].load(std::memory_order_relaxed);
+	return h;
+}
@@ -0,0 +1,133 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cmath>
+
+#include <JuceHeader.h>
+
+#include "CycleCounter.h"
+
+// Per-instance CPU meter for the processing callback.
+//
+// The audio thread times each call with CycleCounter and records the result
+// in lock-free histograms of time per block & time per sample, along with the
+// fraction of the real-time budget used (block duration at the prepared
+// sample rate). Any thread may read the results at any time; readings are
+// individually atomic, but not a consistent snapshot across counters.
+//
+// Everything is recorded in raw counter ticks, and only converted to time
+// when read, so the counter's rate is measured by the first reader rather
+// than holding up prepareToPlay.
+class ProcessMeter
+{
+	public:
+		// Histogram buckets are powers of two of counter ticks, so bucket i
+		// counts durations in [2^i, 2^(i+1)) ticks. Bucket 0 also takes
+		// anything under 1 tick; the last bucket takes anything longer.
+		static int constexpr numBuckets = 32;
+
+		ProcessMeter() = default;
+
+		// Message thread, from prepareToPlay: set the real-time budget &
+		// clear all statistics
+		void prepare(double sampleRate, int maximumExpectedSamplesPerBlock);
+
+		// Message thread: clear statistics without changing the budget
+		void reset();
+
+		// Audio thread: RAII timer for one call of the processing callback
+		class ScopedTimer
+		{
+			public:
+				ScopedTimer(ProcessMeter & meter, int numSamples)
+					: m_meter(meter), m_numSamples(numSamples),
+					m_start(CycleCounter::now())
+				{}
+
+				~ScopedTimer()
+				{
+					m_meter.record(CycleCounter::now() - m_start,
+							m_numSamples);
+				}
+
+			private:
+				ProcessMeter & m_meter;
+				int m_numSamples;
+				uint64_t m_start;
+		};
+
+		struct Stats
+		{
+			// Duration of the largest block promised by prepareToPlay
+			double budgetNs;
+			uint64_t numBlocks;
+			// Most recent block
+			double lastBlockNs;
+			// Fraction of the block's own duration spent processing it
+			double lastLoad;
+			// Since last reset
+			double meanNsPerSample;
+			double peakBlockNs;
+			double peakLoad;
+		};
+
+		// Not real-time safe on first call, which measures the counter's
+		// rate
+		Stats getStats() const;
+
+		// Copy out bucket counts for time per block & time per sample
+		std::array<uint64_t, numBuckets> getBlockHistogram() const;
+		std::array<uint64_t, numBuckets> getSampleHistogram() const;
+
+		// Convert a bucket index to the lower bound of its range, in ns. As
+		// with getStats, not real-time safe on first call.
+		static double bucketLowerBoundNs(int bucket)
+		{
+			return bucket == 0 ? 0.0
+				: std::ldexp(1.0, bucket) * nsPerTick();
+		}
+
+	private:
+		JUCE_DECLARE_NON_COPYABLE (ProcessMeter)
+
+		void record(uint64_t ticks, int numSamples);
+		static int bucketFor(double ticks);
+
+		static double nsPerTick()
+		{
+			return 1e9 / CycleCounter::ticksPerSecond();
+		}
+
+		// Set up on the message thread while the audio thread is stopped
+		double m_sampleRate = 0;
+		double m_budgetNs = 0;
+
+		// In ticks. Loads are in ticks per second of audio processed, i.e.
+		// still need dividing by the counter's rate.
+		std::atomic<uint64_t> m_numBlocks{0};
+		std::atomic<uint64_t> m_totalSamples{0};
+		std::atomic<double> m_totalTicks{0};
+		std::atomic<double> m_lastBlockTicks{0};
+		std::atomic<double> m_lastLoad{0};
+		std::atomic<double> m_peakBlockTicks{0};
+		std::atomic<double> m_peakLoad{0};
+
+		std::array<std::atomic<uint64_t>, numBuckets> m_blockBuckets{};
+		std::array<std::atomic<uint64_t>, numBuckets> m_sampleBuckets{};
+};
@@ -0,0 +1,277 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <limits>
+
+#include "DebugLog.h"
+#include "Recorder.h"
+
+namespace
+{
+	// Seconds of audio the ring can hold while the writer catches up
+	double constexpr ringSeconds = 2;
+	// Headroom for record headers & parameter changes
+	int constexpr ringSlack = 1 << 16;
+	int constexpr maxRingSize = 1 << 28;
+}
+
+Recorder::Recorder() : juce::Thread("Recorder")
+{
+	std::fill(std::begin(m_values), std::end(m_values),
+			std::numeric_limits<float>::quiet_NaN());
+}
+
+Recorder::~Recorder()
+{
+	stop();
+}
+
+//
+// Reading
+//
+
+Recorder::Reader::Reader(void const * data, size_t size)
+	: m_data(static_cast<char const *>(data)), m_size(size)
+{
+	FileHeader header;
+	if (m_size < sizeof(header))
+		return;
+	std::memcpy(&header, m_data, sizeof(header));
+	m_valid = std::memcmp(header.magic, magic, sizeof(magic)) == 0
+		&& header.version == version;
+	m_pos = sizeof(header);
+}
+
+bool Recorder::Reader::next(RecordHeader & header, void const *& payload)
+{
+	if (!m_valid || m_size - m_pos < sizeof(header))
+		return false;
+	std::memcpy(&header, m_data + m_pos, sizeof(header));
+	if (m_size - m_pos - sizeof(header) < header.size)
+		return false;
+
+	payload = m_data + m_pos + sizeof(header);
+	m_pos += sizeof(header) + header.size;
+	return true;
+}
+
+//
+// Recording
+//
+
+bool Recorder::prepare(juce::File const & file, double sampleRate,
+		int maxBlockSize, int numChannels, int sampleSize, bool nonRealtime)
+{
+	// Flush & park the writer while the ring is replaced
+	stopThread(1000);
+	drain();
+
+	if (m_stream == nullptr)
+	{
+		file.getParentDirectory().createDirectory();
+		m_stream = file.createOutputStream();
+		if (m_stream == nullptr || m_stream->failedToOpen())
+		{
+#ifdef SUPSEP_LOGGING
+			DebugLog::log("rec", "Couldn't create " + file.getFullPathName());
+#endif
+			m_stream.reset();
+			return false;
+		}
+
+		FileHeader header{};
+		std::memcpy(header.magic, magic, sizeof(magic));
+		header.version = version;
+		m_stream->write(&header, sizeof(header));
+#ifdef SUPSEP_LOGGING
+		DebugLog::log("rec", "Recording to " + file.getFullPathName());
+#endif
+	}
+
+	double const bytes = ringSeconds * sampleRate * numChannels * sampleSize;
+	int const size = static_cast<int>(juce::jmin<double>(maxRingSize,
+				std::ceil(bytes))) + ringSlack;
+	m_ring.allocate(static_cast<size_t>(size), false);
+	m_fifo.setTotalSize(size);
+	m_dropped = 0;
+	std::fill(std::begin(m_values), std::end(m_values),
+			std::numeric_limits<float>::quiet_NaN());
+
+	Prepare const prepare{sampleRate, maxBlockSize, sampleSize,
+		nonRealtime ? 1 : 0, 0};
+	if (begin(Type::prepare, padded(sizeof(prepare))))
+	{
+		write(&prepare, sizeof(prepare));
+		commit();
+	}
+
+	m_recording.store(true);
+	startThread();
+	return true;
+}
+
+void Recorder::stop()
+{
+	m_recording.store(false);
+	stopThread(1000);
+	drain();
+	m_stream.reset();
+}
+
+void Recorder::pushParameters(juce::Array<juce::AudioProcessorParameter *>
+		const & params)
+{
+	if (!isRecording())
+		return;
+
+	int const n = juce::jmin(params.size(), maxParameters);
+	for (int i = 0; i < n; ++i)
+	{
+		float const value = params.getUnchecked(i)->getValue();
+		if (value == m_values[i])
+			continue;
+
+		// Try again next block if there's no room
+		Parameter const p{i, value};
+		if (!begin(Type::parameter, padded(sizeof(p))))
+			return;
+		write(&p, sizeof(p));
+		commit();
+		m_values[i] = value;
+	}
+}
+
+template<typename SampleType>
+void Recorder::pushBlock(SampleType const * const * main, int numMain,
+		SampleType const * const * side, int numSide, int numSamples)
+{
+	if (!isRecording())
+		return;
+
+	if (m_dropped > 0)
+	{
+		Gap const gap{m_dropped, 0};
+		if (!begin(Type::gap, padded(sizeof(gap))))
+		{
+			++m_dropped;
+			return;
+		}
+		write(&gap, sizeof(gap));
+		commit();
+		m_dropped = 0;
+	}
+
+	size_t const channelBytes = sizeof(SampleType)
+		* static_cast<size_t>(numSamples);
+	Block const block{numSamples, static_cast<int16_t>(numMain),
+		static_cast<int16_t>(numSide),
+		static_cast<int32_t>(sizeof(SampleType)), 0};
+	if (!begin(Type::block, padded(sizeof(block) + channelBytes
+					* static_cast<size_t>(numMain + numSide))))
+	{
+		++m_dropped;
+		return;
+	}
+
+	write(&block, sizeof(block));
+	for (int j = 0; j < numMain; ++j)
+		write(main[j], channelBytes);
+	for (int j = 0; j < numSide; ++j)
+		write(side[j], channelBytes);
+	commit();
+}
+
+bool Recorder::begin(Type type, uint32_t size)
+{
+	RecordHeader const header{type, size};
+	int const total = static_cast<int>(sizeof(header) + size);
+	if (m_fifo.getFreeSpace() < total)
+		return false;
+
+	m_fifo.prepareToWrite(total, m_start1, m_size1, m_start2, m_size2);
+	m_written = 0;
+	write(&header, sizeof(header));
+	return true;
+}
+
+void Recorder::write(void const * data, size_t size)
+{
+	auto src = static_cast<char const *>(data);
+	int n = static_cast<int>(size);
+	if (m_written < m_size1)
+	{
+		int const n1 = juce::jmin(n, m_size1 - m_written);
+		std::memcpy(m_ring + m_start1 + m_written, src, static_cast<size_t>(
+					n1));
+		m_written += n1;
+		src += n1;
+		n -= n1;
+	}
+	if (n > 0)
+	{
+		std::memcpy(m_ring + m_start2 + (m_written - m_size1), src,
+				static_cast<size_t>(n));
+		m_written += n;
+	}
+}
+
+void Recorder::commit()
+{
+	// Zero the padding, so files are reproducible
+	static char const zeros[8] = {};
+	int const padding = m_size1 + m_size2 - m_written;
+	jassert(padding >= 0 && padding < 8);
+	write(zeros, static_cast<size_t>(padding));
+	m_fifo.finishedWrite(m_size1 + m_size2);
+}
+
+//
+// Writer thread
+//
+
+void Recorder::run()
+{
+	// Poll rather than have the audio thread signal us, as for DebugLog
+	while (!threadShouldExit())
+	{
+		drain();
+		wait(20);
+	}
+}
+
+void Recorder::drain()
+{
+	if (m_stream == nullptr)
+		return;
+
+	int start1, size1, start2, size2;
+	m_fifo.prepareToRead(m_fifo.getNumReady(), start1, size1, start2, size2);
+	if (size1 > 0)
+		m_stream->write(m_ring + start1, static_cast<size_t>(size1));
+	if (size2 > 0)
+		m_stream->write(m_ring + start2, static_cast<size_t>(size2));
+	m_fifo.finishedRead(size1 + size2);
+	if (size1 + size2 > 0)
+		m_stream->flush();
+}
+
+template void Recorder::pushBlock<float>(float const * const *, int,
+		float const * const *, int, int);
+template void Recorder::pushBlock<double>(double const * const *, int,
+		double const * const *, int, int);
@@ -0,0 +1,205 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include <JuceHeader.h>
+
+// Captures everything needed to reproduce a run of the processing callback -
+// input audio, block sizes & parameter changes - so a CPU spike or glitch
+// seen in a real session can be replayed offline, under a profiler, through
+// the same engine (see the benchmark's --replay option).
+//
+// The audio thread copies each block into a preallocated single-producer,
+// single-consumer byte ring; a background thread writes the ring out to
+// file. Nothing on the audio thread blocks, allocates or touches the file
+// system: if the ring is full, the block is dropped and the writer notes the
+// gap, so the replay is no longer exact from that point on.
+//
+// Files are a small header followed by a sequence of records, each a header
+// & payload padded to 8 bytes, in host byte order. Everything is naturally
+// aligned, so a reader can memory-map the file & use the samples in place.
+class Recorder : private juce::Thread
+{
+	public:
+		Recorder();
+		~Recorder() override;
+
+		//
+		// File format
+		//
+
+		static char constexpr magic[8] = {'S', 'u', 'p', 'S', 'e', 'p', 'R',
+			'c'};
+		static uint32_t constexpr version = 2;
+
+		struct FileHeader
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t reserved;
+		};
+
+		enum class Type : uint32_t
+		{
+			// Payload: Prepare
+			prepare = 1,
+			// Payload: Parameter
+			parameter = 2,
+			// Payload: Block, then each main channel's samples, then each
+			// sidechain channel's
+			block = 3,
+			// Payload: Gap
+			gap = 4
+		};
+
+		struct RecordHeader
+		{
+			Type type;
+			// Payload size, including padding
+			uint32_t size;
+		};
+
+		struct Prepare
+		{
+			double sampleRate;
+			int32_t maxBlockSize;
+			// 4 for single precision, 8 for double
+			int32_t sampleSize;
+			// Non-zero for an offline render, which takes heavier paths
+			int32_t nonRealtime;
+			int32_t reserved;
+		};
+
+		// Applies to all blocks after it. Values are normalised, 0 to 1.
+		struct Parameter
+		{
+			int32_t index;
+			float value;
+		};
+
+		struct Block
+		{
+			int32_t numSamples;
+			int16_t numMain;
+			int16_t numSide;
+			int32_t sampleSize;
+			int32_t reserved;
+		};
+
+		// Blocks were dropped here as the writer couldn't keep up
+		struct Gap
+		{
+			uint32_t numBlocks;
+			uint32_t reserved;
+		};
+
+		// Walks the records of a recording held in memory. Payloads are
+		// returned in place, so the data must outlive the reader.
+		class Reader
+		{
+			public:
+				Reader(void const * data, size_t size);
+
+				// Whether the data starts with a header we understand
+				bool isValid() const
+				{
+					return m_valid;
+				}
+
+				// Step to the next record, returning false at the end of the
+				// data, or if the next record is truncated
+				bool next(RecordHeader & header, void const *& payload);
+
+			private:
+				char const * m_data;
+				size_t m_size;
+				size_t m_pos = 0;
+				bool m_valid = false;
+		};
+
+		//
+		// Recording
+		//
+
+		// Message thread: start recording to the given file, if not already
+		// recording, and note new playback settings. Allocates the ring for
+		// the given settings, so call from prepareToPlay.
+		bool prepare(juce::File const & file, double sampleRate,
+				int maxBlockSize, int numChannels, int sampleSize,
+				bool nonRealtime);
+
+		// Message thread: flush everything recorded so far & close the file
+		void stop();
+
+		bool isRecording() const
+		{
+			return m_recording.load(std::memory_order_relaxed);
+		}
+
+		// Audio thread: record any parameters whose values have changed
+		// since the last call. Call before pushBlock.
+		void pushParameters(juce::Array<juce::AudioProcessorParameter *> const
+				& params);
+
+		// Audio thread: record a block of input, before it's overwritten by
+		// processing
+		template<typename SampleType>
+		void pushBlock(SampleType const * const * main, int numMain,
+				SampleType const * const * side, int numSide,
+				int numSamples);
+
+	private:
+		JUCE_DECLARE_NON_COPYABLE (Recorder)
+
+		void run() override;
+		void drain();
+
+		// Audio thread: reserve space for a whole record & write its
+		// header, or return false if there isn't room. Follow with writes
+		// totalling exactly size bytes, then commit().
+		bool begin(Type type, uint32_t size);
+		void write(void const * data, size_t size);
+		void commit();
+
+		static uint32_t padded(size_t size)
+		{
+			return static_cast<uint32_t>((size + 7) & ~size_t(7));
+		}
+
+		std::atomic<bool> m_recording{false};
+		std::unique_ptr<juce::FileOutputStream> m_stream;
+
+		juce::AbstractFifo m_fifo{1};
+		juce::HeapBlock<char> m_ring;
+		// Space reserved for the record being written by the audio thread,
+		// in up to two runs, and how much of it has been written so far
+		int m_start1 = 0;
+		int m_size1 = 0;
+		int m_start2 = 0;
+		int m_size2 = 0;
+		int m_written = 0;
+
+		// Last recorded value of each parameter, NaN if none yet
+		static int constexpr maxParameters = 32;
+		float m_values[maxParameters];
+
+		// Blocks dropped since the last gap record
+		uint32_t m_dropped = 0;
+};
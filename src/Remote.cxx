@@ -25,15 +25,58 @@ Remote::Remote(SuperSeparator * owner)
 #endif
 }
 
+bool Remote::readLinked(float & delay, float & fraction, int & invert) const
+{
+	// Quick check, so instances that aren't following anyone in this
+	// process don't touch the instance manager at all. Leaders in other
+	// processes are read straight out of shared memory.
+	if (m_leader.load(std::memory_order_relaxed) == nullptr)
+	{
+		uint64_t const shared = m_sharedLeader.load(
+				std::memory_order_acquire);
+		uint64_t v;
+		return shared != 0 && SharedRegistry::get()->read(
+				SharedRegistry::Handle::unpack(shared), v)
+			&& unpack(v, delay, fraction, invert);
+	}
+
+	// Re-read the leader pointer now it's pinned, as it may have been
+	// cleared if the leader is being unregistered
+	auto guard = InstanceManager::get()->instances();
+	Remote const * leader = m_leader.load(std::memory_order_acquire);
+	if (leader == nullptr)
+		return false;
+
+	return unpack(leader->m_published.load(std::memory_order_acquire),
+			delay, fraction, invert);
+}
+
+bool Remote::unpack(uint64_t v, float & delay, float & fraction,
+		int & invert)
+{
+	if ((v & validBit) == 0)
+		return false;
+
+	uint32_t const d = static_cast<uint32_t>(v >> 32);
+	std::memcpy(&delay, &d, sizeof(delay));
+	fraction = static_cast<float>((v >> 16) & 0xffff) / fractionScale;
+	invert = static_cast<int>(v & 0xff);
+	return true;
+}
+
 Remote::InstancesListener::InstancesListener(Remote * remote)
 	: m_remote(remote)
 {
 }
 
-void Remote::InstancesListener::changeListenerCallback(
-		juce::ChangeBroadcaster *)
+void Remote::InstancesListener::instancesChanged(
+		InstanceManager::Delta const & delta)
 {
 #ifdef SUPSEP_LOGGING
-	DebugLog::log(m_remote->m_logname, "Notified of instance list change");
+	DebugLog::logValue(m_remote->m_logname,
+			"Notified of instance list change, generation",
+			static_cast<juce::int64>(delta.generation));
+#else
+	juce::ignoreUnused(delta);
 #endif
 }
@@ -15,27 +15,46 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstring>
+
 #include <JuceHeader.h>
 
+#include "InstanceManager.h"
+#include "SharedRegistry.h"
+
 // Forward declare parent class to avoid header dependency loop
 class SuperSeparator;
 
+// Per-instance endpoint for linking instances together. A leader publishes
+// its delay & invert values here; a follower keeps track of which leader it
+// wants to follow, and picks up that leader's values on the audio thread.
+//
+// Values travel through a single atomic word per leader, so followers never
+// see a torn delay/invert pair and never need to take the manager lock. The
+// follower's pointer to its leader is only ever changed by the
+// InstanceManager with its lock held, and is cleared before the leader's
+// unregistration completes; readers pin it with an InstanceManager::ReadGuard
+// so the leader can't disappear out from under them mid-read.
+//
+// Leaders also publish into their slot in the SharedRegistry, if they have
+// one, and followers whose leader is in another process read from there.
 class Remote
 {
 	public:
 		Remote(SuperSeparator * owner);
 
-		class InstancesListener : public juce::ChangeListener
+		class InstancesListener : public InstanceManager::Listener
 		{
 			public:
 				InstancesListener(Remote * remote);
-				void changeListenerCallback(juce::ChangeBroadcaster *)
+				void instancesChanged(InstanceManager::Delta const & delta)
 					override;
 			private:
 				Remote * m_remote;
 		};
 
-		juce::ChangeListener * getInstancesListener()
+		InstanceManager::Listener * getInstancesListener()
 		{
 			return &m_instancesListener;
 		}
@@ -45,11 +64,73 @@ class Remote
 			return m_available;
 		}
 
+		// Leader side, any thread: publish current parameter values for
+		// followers to pick up. The delay in ms travels as the bits of a
+		// float; the fine delay with 16 bits of precision. Bits 9 to 15 are
+		// left clear for the SharedRegistry.
+		void publish(float delay, float fraction, int invert)
+		{
+			uint32_t d;
+			std::memcpy(&d, &delay, sizeof(d));
+			auto const f = static_cast<uint64_t>(juce::jlimit(0, 0xffff,
+						juce::roundToInt(fraction * fractionScale)));
+			uint64_t const v = validBit
+				| (static_cast<uint64_t>(d) << 32)
+				| (f << 16)
+				| static_cast<uint64_t>(invert & 0xff);
+			m_published.store(v);
+
+			uint64_t const shared = m_shared.load();
+			if (shared != 0)
+			{
+				SharedRegistry::get()->publish(
+						SharedRegistry::Handle::unpack(shared), v);
+			}
+		}
+
+		// Follower side, audio thread: if following a leader which is
+		// currently registered, overwrite delay, fraction & invert with its
+		// values and return true. Lock-free & allocation-free.
+		bool readLinked(float & delay, float & fraction, int & invert) const;
+
+		// UUID of the leader this instance wants to follow, or null. Message
+		// thread only.
+		juce::Uuid const & getLeaderUuid() const
+		{
+			return m_leaderUuid;
+		}
+
 	private:
+		friend class InstanceManager;
+
+		static uint64_t constexpr validBit = 1 << 8;
+		static float constexpr fractionScale = 65536.0f;
+
 		SuperSeparator * m_owner;
 		InstancesListener m_instancesListener;
 		bool m_available = true;
 
+		// Written by the owning leader's parameters
+		std::atomic<uint64_t> m_published{0};
+
+		// Our slot in the SharedRegistry, as a packed handle, or zero if we
+		// don't have one. Only changed by the InstanceManager with its lock
+		// held.
+		std::atomic<uint64_t> m_shared{0};
+
+		// Follower state, only changed by the InstanceManager with its lock
+		// held. The leader pointer is null whenever the leader isn't
+		// registered, even if we still want to follow it.
+		juce::Uuid m_leaderUuid{juce::Uuid::null()};
+		std::atomic<Remote const *> m_leader{nullptr};
+		// Leader's SharedRegistry slot, as a packed handle, if the leader is
+		// registered in another process
+		std::atomic<uint64_t> m_sharedLeader{0};
+
+		// Unpack a published value, if valid
+		static bool unpack(uint64_t v, float & delay, float & fraction,
+				int & invert);
+
 #ifdef SUPSEP_LOGGING
 		juce::String m_logname;
 #endif
@@ -0,0 +1,101 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+
+#include <JuceHeader.h>
+
+#include "DelayEngine.h"
+
+// Inner loop of the separator, specialised at compile time on precision,
+// invert mode and channel layout. Picking a kernel once per block means the
+// per-chunk work has constant channel trip counts and fixed polarity, so it
+// boils down to straight-line copies & adds with no multiplies by +/-1.
+//
+// Each kernel processes one chunk of at most the delay engine's maximum
+// chunk size, producing:
+//   main + delayed main * main coeff + side + delayed side * side coeff
+// where the coefficients are (1, -1), or (-1, 1) when inverting, and the
+// undelayed main & side are themselves delayed by the engine's latency. Main
+// input and output may share memory. Delay engine channels are the main inputs
+// followed by the sidechain inputs, starting at channel maxChannels.
+template<typename SampleType>
+class SeparatorKernel
+{
+	public:
+		// Largest channel count per bus we have kernels for
+		static int constexpr maxChannels = 2;
+
+		using Function = void (*)(DelayEngine<SampleType> & delay,
+				SampleType const * const * main,
+				SampleType const * const * side, SampleType * const * dst,
+				int start, int numSamples);
+
+		// Choose the kernel for a block. Sidechain channels without a main
+		// channel to mix into are ignored.
+		static Function select(bool invert, int numMain, int numSide)
+		{
+			jassert(numMain >= 0 && numMain <= maxChannels);
+			jassert(numSide >= 0 && numSide <= maxChannels);
+			numMain = juce::jlimit(0, maxChannels, numMain);
+			numSide = juce::jlimit(0, numMain, numSide);
+
+			static constexpr Table table = {{
+				{{ row<false, 0>(), row<false, 1>(), row<false, 2>() }},
+				{{ row<true, 0>(), row<true, 1>(), row<true, 2>() }}
+			}};
+			return table[invert ? 1 : 0][static_cast<size_t>(numMain)]
+				[static_cast<size_t>(numSide)];
+		}
+
+	private:
+		template<bool Invert, int NumMain, int NumSide>
+		static void process(DelayEngine<SampleType> & delay,
+				SampleType const * const * main,
+				SampleType const * const * side, SampleType * const * dst,
+				int start, int numSamples)
+		{
+			for (int j = 0; j < NumMain; ++j)
+			{
+				delay.template process<Invert, false>(j, main[j] + start,
+						dst[j] + start, numSamples);
+			}
+
+			for (int j = 0; j < NumSide; ++j)
+			{
+				delay.template process<!Invert, true>(j + maxChannels,
+						side[j] + start, dst[j] + start, numSamples);
+			}
+
+			delay.advance(numSamples);
+		}
+
+		using Row = std::array<Function, maxChannels + 1>;
+		using Table = std::array<std::array<Row, maxChannels + 1>, 2>;
+
+		// Entries with more sidechain than main channels are never
+		// selected; fill them with the nearest valid kernel anyway
+		template<bool Invert, int NumMain>
+		static constexpr Row row()
+		{
+			return {{
+				&process<Invert, NumMain, 0>,
+				&process<Invert, NumMain, NumMain < 1 ? NumMain : 1>,
+				&process<Invert, NumMain, NumMain < 2 ? NumMain : 2>
+			}};
+		}
+};
@@ -0,0 +1,509 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include "DebugLog.h"
+#include "SharedRegistry.h"
+
+#if JUCE_LINUX || JUCE_BSD || JUCE_MAC
+#define SUPSEP_SHARED_REGISTRY 1
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+SharedRegistry SharedRegistry::m_singleton;
+
+// Slots are padded to whole cache lines, so instances in different
+// processes don't contend over each other's heartbeats & published values
+struct alignas(64) SharedRegistry::Slot
+{
+	// Token of the process holding the slot, or zero if free
+	std::atomic<uint64_t> owner;
+	// Seqlock over uuid & leader; odd while they are being written
+	std::atomic<uint32_t> seq;
+	// Incremented every time the slot is claimed
+	std::atomic<uint32_t> claim;
+	std::atomic<uint64_t> uuid[2];
+	std::atomic<uint64_t> leader[2];
+	std::atomic<uint64_t> published;
+	std::atomic<uint32_t> heartbeat;
+	// ID of the owning process, so a crash can be noticed straight away,
+	// and the PID namespace it means something in
+	std::atomic<int32_t> pid;
+	std::atomic<uint64_t> pidNamespace;
+};
+
+struct SharedRegistry::Segment
+{
+	alignas(64) std::atomic<uint32_t> version;
+	std::atomic<uint32_t> generation;
+	Slot slots[maxSlots];
+};
+
+// The segment starts out zero filled, which has to be a valid initial state
+// for every atomic in it, and atomics only work between processes if they
+// don't rely on a lock
+static_assert(std::atomic<uint64_t>::is_always_lock_free
+		&& std::atomic<uint32_t>::is_always_lock_free,
+		"Shared memory needs lock-free atomics");
+
+namespace
+{
+	// Bump whenever the segment layout changes. Part of the segment name,
+	// so old & new builds running side by side don't trample each other.
+	uint32_t constexpr layoutVersion = 3;
+
+	// Give up reading a slot which is changing this many times in a row
+	int constexpr maxReadAttempts = 16;
+
+	// Published values carry a tag derived from the claim which wrote them,
+	// in bits Remote leaves clear, so a late write from an instance which
+	// has since released its slot can't overwrite the next owner's values.
+	// Never zero, so a cleared slot matches nobody.
+	int constexpr tagShift = 9;
+	uint64_t constexpr tagMask = uint64_t(0x7f) << tagShift;
+
+	uint64_t tag(uint32_t claim)
+	{
+		return static_cast<uint64_t>(claim % 127 + 1) << tagShift;
+	}
+
+	uint32_t now()
+	{
+		using namespace std::chrono;
+		return static_cast<uint32_t>(duration_cast<milliseconds>(
+					steady_clock::now().time_since_epoch()).count());
+	}
+
+	int32_t currentPid()
+	{
+#if SUPSEP_SHARED_REGISTRY
+		return static_cast<int32_t>(getpid());
+#else
+		return 0;
+#endif
+	}
+
+	// Identifies the PID namespace we're in, as sandboxes often give each
+	// process its own, and a process ID means nothing outside its
+	// namespace. Zero if unknown.
+	uint64_t currentPidNamespace()
+	{
+#if JUCE_LINUX
+		static uint64_t const ns = []
+		{
+			struct stat st;
+			return stat("/proc/self/ns/pid", &st) == 0
+				? static_cast<uint64_t>(st.st_ino) : uint64_t(0);
+		}();
+		return ns;
+#elif SUPSEP_SHARED_REGISTRY
+		// No PID namespaces, so everything shares the one
+		return 1;
+#else
+		return 0;
+#endif
+	}
+
+	// Whether the given process has definitely exited. Everything sharing
+	// the segment runs as the same user, so can be signalled if it exists,
+	// but only processes in our own PID namespace can be checked. Anything
+	// else, or a process whose ID has been reused, is left to the
+	// heartbeat.
+	bool processGone(uint64_t pidNamespace, int32_t pid)
+	{
+#if SUPSEP_SHARED_REGISTRY
+		return pid > 0 && pidNamespace != 0
+			&& pidNamespace == currentPidNamespace()
+			&& kill(static_cast<pid_t>(pid), 0) != 0 && errno == ESRCH;
+#else
+		juce::ignoreUnused(pidNamespace, pid);
+		return false;
+#endif
+	}
+
+	void storeUuid(std::atomic<uint64_t> (& dst)[2], juce::Uuid const & uuid)
+	{
+		uint64_t words[2];
+		std::memcpy(words, uuid.getRawData(), sizeof(words));
+		dst[0].store(words[0], std::memory_order_relaxed);
+		dst[1].store(words[1], std::memory_order_relaxed);
+	}
+
+	juce::Uuid loadUuid(std::atomic<uint64_t> const (& src)[2])
+	{
+		uint64_t const words[2] = {
+			src[0].load(std::memory_order_relaxed),
+			src[1].load(std::memory_order_relaxed)
+		};
+		juce::uint8 raw[sizeof(words)];
+		std::memcpy(raw, words, sizeof(raw));
+		return juce::Uuid(raw);
+	}
+
+	// Seqlock writer side: everything stored between begin & end is seen
+	// by readers either all or not at all
+	void beginWrite(std::atomic<uint32_t> & seq)
+	{
+		seq.store(seq.load(std::memory_order_relaxed) + 1,
+				std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	void endWrite(std::atomic<uint32_t> & seq)
+	{
+		seq.store(seq.load(std::memory_order_relaxed) + 1,
+				std::memory_order_release);
+	}
+}
+
+SharedRegistry::~SharedRegistry()
+{
+#if SUPSEP_SHARED_REGISTRY
+	// The segment itself is left in place for other processes; it's small,
+	// and goes away on reboot. Anything still calling in from other
+	// statics' destructors finds it gone, rather than unmapped.
+	m_openFailed = true;
+	if (Segment * segment = m_segment.exchange(nullptr))
+		munmap(segment, sizeof(Segment));
+#endif
+}
+
+bool SharedRegistry::open()
+{
+	if (m_segment.load(std::memory_order_acquire) != nullptr)
+		return true;
+	if (m_openFailed)
+		return false;
+	m_openFailed = true;
+
+#if SUPSEP_SHARED_REGISTRY
+	while (m_token == 0)
+	{
+		m_token = static_cast<uint64_t>(
+				juce::Random::getSystemRandom().nextInt64());
+	}
+
+	// One registry per user, as that's as far as anyone can link instances
+	juce::String const name = juce::String("/supsep-registry-")
+		+ juce::String(layoutVersion) + '-'
+		+ juce::String(static_cast<juce::int64>(getuid()));
+	int const fd = shm_open(name.toRawUTF8(), O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+	{
+#ifdef SUPSEP_LOGGING
+		DebugLog::log("shm", "Couldn't open shared registry " + name);
+#endif
+		return false;
+	}
+
+	// Whoever gets here first sizes the segment; new segments are zero
+	// filled. Only size it if that hasn't been done, as macOS refuses to
+	// resize shared memory. If two processes race to do it, the loser's
+	// ftruncate may fail, but the segment is sized all the same.
+	void * mapping = MAP_FAILED;
+	auto const isSized = [fd]
+	{
+		struct stat st;
+		return fstat(fd, &st) == 0
+			&& st.st_size >= static_cast<off_t>(sizeof(Segment));
+	};
+	if (isSized() || ftruncate(fd, sizeof(Segment)) == 0 || isSized())
+	{
+		mapping = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+#ifdef SUPSEP_LOGGING
+		DebugLog::log("shm", "Couldn't map shared registry " + name);
+#endif
+		return false;
+	}
+
+	auto segment = static_cast<Segment *>(mapping);
+	uint32_t version = 0;
+	if (!segment->version.compare_exchange_strong(version, layoutVersion)
+			&& version != layoutVersion)
+	{
+#ifdef SUPSEP_LOGGING
+		DebugLog::log("shm", "Shared registry has unknown layout");
+#endif
+		munmap(mapping, sizeof(Segment));
+		return false;
+	}
+
+#ifdef SUPSEP_LOGGING
+	DebugLog::log("shm", "Opened shared registry " + name);
+#endif
+	m_openFailed = false;
+	m_segment.store(segment, std::memory_order_release);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void SharedRegistry::disable()
+{
+	jassert(m_segment.load() == nullptr);
+	m_openFailed = true;
+}
+
+SharedRegistry::Slot * SharedRegistry::slot(Handle handle) const
+{
+	Segment * segment = m_segment.load(std::memory_order_acquire);
+	if (segment == nullptr || handle.slot < 0 || handle.slot >= maxSlots)
+		return nullptr;
+	return &segment->slots[handle.slot];
+}
+
+void SharedRegistry::bumpGeneration()
+{
+	m_segment.load()->generation.fetch_add(1, std::memory_order_release);
+}
+
+uint32_t SharedRegistry::getGeneration() const
+{
+	Segment * segment = m_segment.load(std::memory_order_acquire);
+	return segment != nullptr
+		? segment->generation.load(std::memory_order_acquire) : 0;
+}
+
+//
+// Claiming & releasing slots
+//
+
+SharedRegistry::Handle SharedRegistry::claim(juce::Uuid const & uuid,
+		juce::Uuid const & leader, uint64_t published)
+{
+	Segment * segment = m_segment.load(std::memory_order_acquire);
+	if (segment == nullptr)
+		return {};
+
+	// Look for a free slot; if there are none, reclaim any abandoned ones &
+	// look again
+	for (int attempt = 0; attempt < 2; ++attempt)
+	{
+		for (int i = 0; i < maxSlots; ++i)
+		{
+			Slot & s = segment->slots[i];
+			uint64_t owner = 0;
+			if (!s.owner.compare_exchange_strong(owner, m_token,
+						std::memory_order_acq_rel))
+				continue;
+
+			uint32_t const claim = s.claim.fetch_add(1,
+					std::memory_order_acq_rel) + 1;
+			beginWrite(s.seq);
+			storeUuid(s.uuid, uuid);
+			storeUuid(s.leader, leader);
+			endWrite(s.seq);
+			s.published.store((published & ~tagMask) | tag(claim),
+					std::memory_order_release);
+			s.heartbeat.store(now(), std::memory_order_relaxed);
+			s.pidNamespace.store(currentPidNamespace(),
+					std::memory_order_relaxed);
+			s.pid.store(currentPid(), std::memory_order_relaxed);
+			bumpGeneration();
+			return {i, claim};
+		}
+		list();
+	}
+
+#ifdef SUPSEP_LOGGING
+	DebugLog::log("shm", "Shared registry full");
+#endif
+	return {};
+}
+
+void SharedRegistry::clearSlot(Slot & s)
+{
+	beginWrite(s.seq);
+	storeUuid(s.uuid, juce::Uuid::null());
+	storeUuid(s.leader, juce::Uuid::null());
+	endWrite(s.seq);
+	s.published.store(0, std::memory_order_release);
+	s.heartbeat.store(0, std::memory_order_relaxed);
+	s.pid.store(0, std::memory_order_relaxed);
+	s.pidNamespace.store(0, std::memory_order_relaxed);
+}
+
+void SharedRegistry::release(Handle handle)
+{
+	Slot * s = slot(handle);
+	if (s == nullptr || s->owner.load() != m_token
+			|| s->claim.load() != handle.claim)
+		return;
+
+	clearSlot(*s);
+	s->owner.store(0, std::memory_order_release);
+	bumpGeneration();
+}
+
+void SharedRegistry::setLeader(Handle handle, juce::Uuid const & leader)
+{
+	Slot * s = slot(handle);
+	if (s == nullptr || s->owner.load() != m_token
+			|| s->claim.load() != handle.claim)
+		return;
+
+	beginWrite(s->seq);
+	storeUuid(s->leader, leader);
+	endWrite(s->seq);
+	bumpGeneration();
+}
+
+bool SharedRegistry::heartbeat(Handle handle)
+{
+	Slot * s = slot(handle);
+	if (s == nullptr || s->owner.load() != m_token
+			|| s->claim.load() != handle.claim)
+		return false;
+
+	s->heartbeat.store(now(), std::memory_order_relaxed);
+	return true;
+}
+
+//
+// Reading
+//
+
+bool SharedRegistry::readEntry(int index, Entry & entry) const
+{
+	Slot const & s = m_segment.load()->slots[index];
+	for (int attempt = 0; attempt < maxReadAttempts; ++attempt)
+	{
+		uint32_t const seq = s.seq.load(std::memory_order_acquire);
+		if (seq & 1)
+			continue;
+
+		uint64_t const owner = s.owner.load(std::memory_order_relaxed);
+		uint32_t const claim = s.claim.load(std::memory_order_relaxed);
+		juce::Uuid const uuid = loadUuid(s.uuid);
+		juce::Uuid const leader = loadUuid(s.leader);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (s.seq.load(std::memory_order_relaxed) != seq)
+			continue;
+
+		// Claimed but not filled in yet, or released since
+		if (owner == 0 || uuid.isNull())
+			return false;
+
+		entry.handle = {index, claim};
+		entry.uuid = uuid;
+		entry.leader = leader;
+		entry.local = owner == m_token;
+		return true;
+	}
+	return false;
+}
+
+std::vector<SharedRegistry::Entry> SharedRegistry::list()
+{
+	std::vector<Entry> entries;
+	Segment * segment = m_segment.load(std::memory_order_acquire);
+	if (segment == nullptr)
+		return entries;
+
+	uint32_t const t = now();
+	for (int i = 0; i < maxSlots; ++i)
+	{
+		Slot & s = segment->slots[i];
+		uint64_t owner = s.owner.load(std::memory_order_acquire);
+		if (owner == 0)
+			continue;
+
+		// Take over slots whose owner has exited, or has stopped stamping
+		// them, then free them. Checking the process catches a crash in
+		// our PID namespace straight away, so a restarted copy can have its
+		// UUID back. Unsigned arithmetic copes with the clock wrapping.
+		if (owner != m_token
+				&& (processGone(
+						s.pidNamespace.load(std::memory_order_relaxed),
+						s.pid.load(std::memory_order_relaxed))
+					|| t - s.heartbeat.load(std::memory_order_relaxed)
+						> staleMs))
+		{
+			if (s.owner.compare_exchange_strong(owner, m_token,
+						std::memory_order_acq_rel))
+			{
+#ifdef SUPSEP_LOGGING
+				DebugLog::logValue("shm", "Reclaiming abandoned slot", i);
+#endif
+				clearSlot(s);
+				s.owner.store(0, std::memory_order_release);
+				bumpGeneration();
+			}
+			continue;
+		}
+
+		Entry entry;
+		if (readEntry(i, entry))
+			entries.push_back(entry);
+	}
+
+	std::sort(entries.begin(), entries.end(),
+			[](Entry const & a, Entry const & b) { return a.uuid < b.uuid; });
+	return entries;
+}
+
+//
+// Linked parameter values
+//
+
+void SharedRegistry::publish(Handle handle, uint64_t published)
+{
+	Slot * s = slot(handle);
+	if (s == nullptr)
+		return;
+
+	uint64_t const t = tag(handle.claim);
+	uint64_t current = s->published.load(std::memory_order_relaxed);
+	do
+	{
+		if ((current & tagMask) != t)
+			return;
+	}
+	while (!s->published.compare_exchange_weak(current,
+				(published & ~tagMask) | t, std::memory_order_release,
+				std::memory_order_relaxed));
+}
+
+bool SharedRegistry::read(Handle handle, uint64_t & published) const
+{
+	Slot const * s = slot(handle);
+	if (s == nullptr
+			|| s->claim.load(std::memory_order_acquire) != handle.claim)
+		return false;
+
+	// Released slots have their value cleared, and claimed slots get a
+	// new tag, so this also catches the slot changing hands after the
+	// check above
+	uint64_t const v = s->published.load(std::memory_order_acquire);
+	if ((v & tagMask) != tag(handle.claim))
+		return false;
+	published = v & ~tagMask;
+	return true;
+}
@@ -0,0 +1,164 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <JuceHeader.h>
+
+// Registry of plugin instances in every process belonging to the current
+// user, so instances can be linked even when the host sandboxes each one
+// into its own process. Complements the InstanceManager, which only knows
+// about instances in this process, and is driven by it.
+//
+// Lives in a named POSIX shared memory segment holding a fixed table of
+// slots, one per registered instance. Nothing in it is ever locked, so a
+// process dying at any point can't wedge the others:
+//  - Slots are claimed by compare-and-swap of an owner token, random per
+//    process, and released by clearing it.
+//  - A slot's UUID & leader are guarded by a per-slot seqlock; readers retry
+//    if they see the sequence number change underneath them.
+//  - Linked parameter values are a single atomic word per slot, in the same
+//    format as Remote's, so are safe to read from the audio thread.
+//  - Owners stamp a heartbeat & their process ID into their slots. Slots
+//    whose heartbeat stops are reclaimed, so instances in a crashed process
+//    don't hang around; straight away if the process is in our own PID
+//    namespace, and so can be seen to have gone.
+//
+// Unavailable on platforms without POSIX shared memory, or if the segment
+// can't be created, in which case registration quietly fails & linking
+// stays in-process only.
+class SharedRegistry
+{
+	public:
+		SharedRegistry(SharedRegistry const &) = delete;
+		SharedRegistry & operator=(SharedRegistry const &) = delete;
+
+		// Get the singleton pointer
+		static SharedRegistry * get()
+		{
+			return &m_singleton;
+		}
+
+		static int constexpr maxSlots = 64;
+
+		// Slots with no heartbeat for this long are considered abandoned
+		static uint32_t constexpr staleMs = 10000;
+
+		// Identifies one particular claim of a slot; stays valid until the
+		// slot is released. Zero is never valid.
+		struct Handle
+		{
+			int slot = -1;
+			uint32_t claim = 0;
+
+			bool isValid() const
+			{
+				return slot >= 0;
+			}
+
+			// Packed into one word, for storing in an atomic
+			uint64_t pack() const
+			{
+				return isValid() ? (static_cast<uint64_t>(slot + 1) << 32)
+					| claim : 0;
+			}
+
+			static Handle unpack(uint64_t v)
+			{
+				return {static_cast<int>(v >> 32) - 1,
+					static_cast<uint32_t>(v)};
+			}
+		};
+
+		// A consistent copy of one registered instance
+		struct Entry
+		{
+			Handle handle;
+			juce::Uuid uuid;
+			juce::Uuid leader;
+			// Registered by this process
+			bool local = false;
+		};
+
+		//
+		// Message thread
+		//
+
+		// Map the segment, if not done already. Returns whether the registry
+		// is usable.
+		bool open();
+
+		// Keep this process out of the registry, so its instances can't be
+		// seen or followed from other processes, e.g. in command line tools.
+		// Call before any instance is registered.
+		void disable();
+
+		// Claim a slot for the given UUID, or return an invalid handle if
+		// none are free
+		Handle claim(juce::Uuid const & uuid, juce::Uuid const & leader,
+				uint64_t published);
+		void release(Handle handle);
+
+		// Record which instance a registered instance is following, so
+		// other processes can refuse chains & cycles
+		void setLeader(Handle handle, juce::Uuid const & leader);
+
+		// Refresh heartbeats. Returns false if the slot has been lost, i.e.
+		// reclaimed by another process after we failed to keep it alive.
+		bool heartbeat(Handle handle);
+
+		// Every registered instance, in every process, sorted by UUID.
+		// Reclaims abandoned slots along the way.
+		std::vector<Entry> list();
+
+		// Changes every time a slot is claimed, released or relinked, in
+		// any process
+		uint32_t getGeneration() const;
+
+		//
+		// Any thread: lock-free, allocation-free
+		//
+
+		// Store a leader's packed parameter values, in Remote's format. Bits
+		// 9 to 15 are reserved for the registry. Does nothing if the slot
+		// has been released.
+		void publish(Handle handle, uint64_t published);
+
+		// Read a leader's packed parameter values, provided the slot is still
+		// held by the same claim
+		bool read(Handle handle, uint64_t & published) const;
+
+	private:
+		SharedRegistry() = default;
+		~SharedRegistry();
+
+		static SharedRegistry m_singleton;
+
+		struct Segment;
+		struct Slot;
+
+		std::atomic<Segment *> m_segment{nullptr};
+		bool m_openFailed = false;
+		uint64_t m_token = 0;
+
+		Slot * slot(Handle handle) const;
+		bool readEntry(int index, Entry & entry) const;
+		void clearSlot(Slot & s);
+		void bumpGeneration();
+};
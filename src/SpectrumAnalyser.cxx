@@ -0,0 +1,193 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#include "SpectrumAnalyser.h"
+
+namespace
+{
+	// Weight given to each new frame in the running averages
+	float constexpr smoothing = 0.2f;
+
+	// Rate input is decimated towards. Anything above this is more than
+	// the view needs.
+	double constexpr analysisRate = 48000;
+}
+
+SpectrumAnalyser::SpectrumAnalyser() : juce::Thread("Spectrum analyser")
+{
+}
+
+SpectrumAnalyser::~SpectrumAnalyser()
+{
+	stop();
+}
+
+void SpectrumAnalyser::start(double sampleRate)
+{
+	stop();
+
+	m_sampleRate = sampleRate > 0 ? sampleRate : analysisRate;
+	int const decimation = juce::jmax(1,
+			static_cast<int>(m_sampleRate / analysisRate));
+	m_binWidth = m_sampleRate / decimation / fftSize;
+
+	if (m_fft == nullptr)
+		m_fft.reset(new juce::dsp::FFT(fftOrder));
+
+	// Hann window, for frames overlapping by half
+	m_window.resize(static_cast<size_t>(fftSize));
+	for (int i = 0; i < fftSize; ++i)
+	{
+		m_window[static_cast<size_t>(i)] = 0.5f - 0.5f * std::cos(
+				juce::MathConstants<float>::twoPi * static_cast<float>(i)
+				/ static_cast<float>(fftSize));
+	}
+
+	m_mainFrame.assign(static_cast<size_t>(fftSize), 0.0f);
+	m_sideFrame.assign(static_cast<size_t>(fftSize), 0.0f);
+	m_mainSpectrum.assign(static_cast<size_t>(fftSize) * 2, 0.0f);
+	m_sideSpectrum.assign(static_cast<size_t>(fftSize) * 2, 0.0f);
+	m_mainPower.assign(static_cast<size_t>(numBins), 0.0f);
+	m_sidePower.assign(static_cast<size_t>(numBins), 0.0f);
+	m_cross.assign(static_cast<size_t>(numBins), {});
+	m_smoothedValid = false;
+
+	{
+		juce::SpinLock::ScopedLockType l(m_resultLock);
+		m_result.binWidth = m_binWidth;
+		m_result.coherence.assign(static_cast<size_t>(numBins), 0.0f);
+		m_result.phase.assign(static_cast<size_t>(numBins), 0.0f);
+		m_result.correlation = 0;
+	}
+
+	// Safe to reallocate, as stop() made sure the producer is out of push()
+	m_fifo.prepare(fftSize * 4, decimation);
+
+	m_active.store(true, std::memory_order_release);
+	startThread();
+}
+
+void SpectrumAnalyser::stop()
+{
+	m_active.store(false);
+	while (m_pushing.load())
+		std::this_thread::yield();
+
+	stopThread(1000);
+}
+
+bool SpectrumAnalyser::getResult(Result & result, uint32_t & sequence)
+{
+	uint32_t const latest = m_sequence.load(std::memory_order_acquire);
+	if (latest == sequence)
+		return false;
+
+	juce::SpinLock::ScopedTryLockType l(m_resultLock);
+	if (!l.isLocked())
+		return false;
+
+	result.binWidth = m_result.binWidth;
+	result.coherence = m_result.coherence;
+	result.phase = m_result.phase;
+	result.correlation = m_result.correlation;
+	sequence = latest;
+	return true;
+}
+
+void SpectrumAnalyser::run()
+{
+	int constexpr hop = fftSize / 2;
+	while (!threadShouldExit())
+	{
+		if (m_fifo.getNumReady() < hop)
+		{
+			wait(20);
+			continue;
+		}
+
+		// Slide the frames along by half & fill in the new half
+		std::copy(m_mainFrame.begin() + hop, m_mainFrame.end(),
+				m_mainFrame.begin());
+		std::copy(m_sideFrame.begin() + hop, m_sideFrame.end(),
+				m_sideFrame.begin());
+		m_fifo.pop(m_mainFrame.data() + hop, m_sideFrame.data() + hop, hop);
+		analyseFrame();
+	}
+}
+
+void SpectrumAnalyser::analyseFrame()
+{
+	int constexpr hop = fftSize / 2;
+
+	// Time domain energies over the new half frame, for the correlation
+	// coefficient
+	double mm = 0, ss = 0, ms = 0;
+	for (int i = hop; i < fftSize; ++i)
+	{
+		double const m = m_mainFrame[static_cast<size_t>(i)];
+		double const s = m_sideFrame[static_cast<size_t>(i)];
+		mm += m * m;
+		ss += s * s;
+		ms += m * s;
+	}
+
+	std::fill(m_mainSpectrum.begin(), m_mainSpectrum.end(), 0.0f);
+	std::fill(m_sideSpectrum.begin(), m_sideSpectrum.end(), 0.0f);
+	juce::FloatVectorOperations::multiply(m_mainSpectrum.data(),
+			m_mainFrame.data(), m_window.data(), fftSize);
+	juce::FloatVectorOperations::multiply(m_sideSpectrum.data(),
+			m_sideFrame.data(), m_window.data(), fftSize);
+
+	m_fft->performRealOnlyForwardTransform(m_mainSpectrum.data(), true);
+	m_fft->performRealOnlyForwardTransform(m_sideSpectrum.data(), true);
+
+	// Running averages of |main|^2, |side|^2 & main * conj(side)
+	float const a = m_smoothedValid ? smoothing : 1.0f;
+	for (int k = 0; k < numBins; ++k)
+	{
+		size_t const i = static_cast<size_t>(k);
+		std::complex<float> x(m_mainSpectrum[2 * i],
+				m_mainSpectrum[2 * i + 1]);
+		std::complex<float> y(m_sideSpectrum[2 * i],
+				m_sideSpectrum[2 * i + 1]);
+		m_mainPower[i] += a * (std::norm(x) - m_mainPower[i]);
+		m_sidePower[i] += a * (std::norm(y) - m_sidePower[i]);
+		m_cross[i] += a * (x * std::conj(y) - m_cross[i]);
+	}
+	m_mainEnergy += a * (mm - m_mainEnergy);
+	m_sideEnergy += a * (ss - m_sideEnergy);
+	m_crossEnergy += a * (ms - m_crossEnergy);
+	m_smoothedValid = true;
+
+	// Hand over. If the message thread happens to be copying the last
+	// result out, it's only a couple of small arrays, so just wait.
+	juce::SpinLock::ScopedLockType l(m_resultLock);
+	for (int k = 0; k < numBins; ++k)
+	{
+		size_t const i = static_cast<size_t>(k);
+		float const power = m_mainPower[i] * m_sidePower[i];
+		m_result.coherence[i] = power > 1e-20f
+			? juce::jmin(1.0f, std::norm(m_cross[i]) / power) : 0.0f;
+		m_result.phase[i] = std::arg(m_cross[i]);
+	}
+	double const energy = std::sqrt(m_mainEnergy * m_sideEnergy);
+	m_result.correlation = energy > 1e-20
+		? static_cast<float>(m_crossEnergy / energy) : 0.0f;
+	m_sequence.fetch_add(1, std::memory_order_release);
+}
@@ -0,0 +1,128 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <complex>
+#include <memory>
+#include <vector>
+
+#include <JuceHeader.h>
+
+#include "AnalysisFifo.h"
+
+// Background analyser for the editor's analysis view, measuring how the main
+// & sidechain inputs relate to each other: per-frequency coherence & phase
+// difference, from smoothed auto & cross spectra, plus an overall
+// correlation coefficient.
+//
+// As with the DelayEstimator, the audio thread only pushes mono mixdowns
+// into a FIFO, decimated at high sample rates as the view doesn't need the
+// bandwidth. Windowing & FFTs happen on the analyser's own thread, and
+// results are handed over to the message thread under a spin lock the
+// message thread only ever tries, so neither side waits for the other.
+class SpectrumAnalyser : private juce::Thread
+{
+	public:
+		static int constexpr fftOrder = 11;
+		static int constexpr fftSize = 1 << fftOrder;
+		static int constexpr numBins = fftSize / 2 + 1;
+
+		struct Result
+		{
+			// Width of each bin in Hz
+			double binWidth = 0;
+			// Magnitude squared coherence, from 0 to 1, per bin
+			std::vector<float> coherence;
+			// Phase of main relative to sidechain in radians, per bin
+			std::vector<float> phase;
+			// Broadband correlation coefficient, from -1 to 1
+			float correlation = 0;
+		};
+
+		SpectrumAnalyser();
+		~SpectrumAnalyser() override;
+
+		// Start/stop analysis. Message thread only. Starting allocates.
+		void start(double sampleRate);
+		void stop();
+
+		bool isActive() const
+		{
+			return m_active.load(std::memory_order_relaxed);
+		}
+
+		// Sample rate given to start()
+		double getSampleRate() const
+		{
+			return m_sampleRate;
+		}
+
+		// Audio thread: feed input, before it is overwritten by processing.
+		// Does nothing unless analysis is active.
+		template<typename SampleType>
+		void push(SampleType const * const * main, int numMain,
+				SampleType const * const * side, int numSide, int numSamples)
+		{
+			if (!m_active.load(std::memory_order_relaxed))
+				return;
+
+			// Flag that we're inside push() so stop() can wait for us to
+			// leave before the FIFO is reallocated
+			m_pushing.store(true);
+			if (m_active.load())
+				m_fifo.push(main, numMain, side, numSide, numSamples);
+			m_pushing.store(false);
+		}
+
+		// Message thread: copy out the latest result, if there's one newer
+		// than the given sequence number & the analyser isn't busy
+		// publishing it, updating the sequence number. Returns whether a
+		// result was copied.
+		bool getResult(Result & result, uint32_t & sequence);
+
+	private:
+		JUCE_DECLARE_NON_COPYABLE (SpectrumAnalyser)
+
+		void run() override;
+		void analyseFrame();
+
+		AnalysisFifo m_fifo;
+		std::atomic<bool> m_active{false};
+		std::atomic<bool> m_pushing{false};
+		double m_sampleRate = 0;
+		double m_binWidth = 0;
+
+		std::unique_ptr<juce::dsp::FFT> m_fft;
+		std::vector<float> m_window;
+		std::vector<float> m_mainFrame;
+		std::vector<float> m_sideFrame;
+		std::vector<float> m_mainSpectrum;
+		std::vector<float> m_sideSpectrum;
+
+		// Smoothed spectra & time domain energies
+		std::vector<float> m_mainPower;
+		std::vector<float> m_sidePower;
+		std::vector<std::complex<float>> m_cross;
+		double m_mainEnergy = 0;
+		double m_sideEnergy = 0;
+		double m_crossEnergy = 0;
+		bool m_smoothedValid = false;
+
+		juce::SpinLock m_resultLock;
+		Result m_result;
+		std::atomic<uint32_t> m_sequence{0};
+};
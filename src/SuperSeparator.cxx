@@ -13,46 +13,247 @@
 // You should have received a copy of the GNU General Public License along
 // with this program. If not, see <https://www.gnu.org/licenses/>.
 
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
 #ifdef SUPSEP_LOGGING
 #include <sstream>
 #endif
 
+#include "ChannelMatrix.h"
 #include "DebugLog.h"
 #include "Editor.h"
 #include "InstanceManager.h"
 #include "Remote.h"
+#include "SeparatorKernel.h"
 #include "SuperSeparator.h"
 
 namespace
 {
-	// Base class for parameters that send notifications to their owning
-	// SuperSeparator's embedded change broadcaster when altered
-	template<class ParamType>
-	class ChangeBroadcastedParam : public ParamType
+	// Compact binary state, used from settings version 2 onwards. All
+	// fields are little-endian:
+	//   4 bytes   magic "SSep"
+	//   4 bytes   settings version
+	//   4 bytes   number of parameter records
+	//   16 bytes  instance UUID
+	//   16 bytes  UUID of instance being followed, or null (version 3+)
+	// followed by a record for each parameter:
+	//   24 bytes  parameter ID, NUL-padded
+	//   8 bytes   plain (not normalised) value, as an IEEE 754 double
+	// Version 1 settings were XML, serialised with copyXmlToBinary.
+	char constexpr stateMagic[4] = {'S', 'S', 'e', 'p'};
+	uint32_t constexpr stateVersion = 3;
+	size_t constexpr stateHeaderSize = 44;
+	size_t constexpr stateV2HeaderSize = 28;
+	size_t constexpr stateIdSize = 24;
+	size_t constexpr stateRecordSize = 32;
+
+	void writeStateUint32(char * dst, uint32_t v)
+	{
+		v = juce::ByteOrder::swapIfBigEndian(v);
+		std::memcpy(dst, &v, sizeof(v));
+	}
+
+	uint32_t readStateUint32(char const * src)
+	{
+		uint32_t v;
+		std::memcpy(&v, src, sizeof(v));
+		return juce::ByteOrder::swapIfBigEndian(v);
+	}
+
+	void writeStateDouble(char * dst, double d)
+	{
+		uint64_t v;
+		std::memcpy(&v, &d, sizeof(v));
+		v = juce::ByteOrder::swapIfBigEndian(v);
+		std::memcpy(dst, &v, sizeof(v));
+	}
+
+	double readStateDouble(char const * src)
+	{
+		uint64_t v;
+		std::memcpy(&v, src, sizeof(v));
+		v = juce::ByteOrder::swapIfBigEndian(v);
+		double d;
+		std::memcpy(&d, &v, sizeof(d));
+		return d;
+	}
+
+	// Length of the adaptive filter. Fixed, so the CPU cost per instance is
+	// too: 512 taps covers about 10ms at 48kHz. Offline renders, which
+	// have no real-time budget to keep to, get a filter four times as long,
+	// so can cancel longer reflections & converge more closely.
+	int constexpr adaptiveTaps = 512;
+	int constexpr offlineAdaptiveTaps = 2048;
+
+	// Delay changes crossfade from the old delay to the new over this long,
+	// so automating them doesn't click
+	double constexpr delayFadeMs = 20;
+
+	// Blocks are processed in chunks of at most this many bytes per
+	// channel, however big the host's blocks are. Each pass over a chunk -
+	// input, output, the delay line write position & taps - then touches a
+	// few times this per channel, which stays in L1 cache for the next.
+	size_t constexpr chunkBytes = 2048;
+
+	template<typename SampleType>
+	int constexpr chunkSize()
+	{
+		return static_cast<int>(chunkBytes / sizeof(SampleType));
+	}
+
+	// Adaptive filtering of a whole block, one channel pair per job, so
+	// that pairs can be filtered in parallel
+	template<typename SampleType>
+	class AdaptiveJob : public Workers::Job
+	{
+		public:
+			AdaptiveJob(AdaptiveFilter<SampleType> & filter,
+					SampleType const * const * main,
+					SampleType const * const * side,
+					SampleType * const * dst, SampleType rate,
+					int numSamples)
+				: m_filter(filter), m_main(main), m_side(side), m_dst(dst),
+				m_rate(rate), m_numSamples(numSamples)
+			{}
+
+			void run(int j) override
+			{
+				int const maxChunk = m_filter.getMaxBlockSize();
+				for (int start = 0; start < m_numSamples; start += maxChunk)
+				{
+					int const n = juce::jmin(maxChunk, m_numSamples - start);
+					m_filter.process(j, m_main[j] + start, m_side[j] + start,
+							m_dst[j] + start, m_rate, n);
+					juce::FloatVectorOperations::add(m_dst[j] + start,
+							m_side[j] + start, n);
+				}
+			}
+
+		private:
+			AdaptiveFilter<SampleType> & m_filter;
+			SampleType const * const * m_main;
+			SampleType const * const * m_side;
+			SampleType * const * m_dst;
+			SampleType m_rate;
+			int m_numSamples;
+	};
+
+	// Sidechain routing choices, as mixes from the sidechain's channels to
+	// the main input's, in parameter order: direct, swapped, mono, left
+	// only & right only
+	template<typename SampleType>
+	ChannelMatrix<SampleType> sideRouting(int index)
+	{
+		switch (index)
+		{
+			case 1:
+				return ChannelMatrix<SampleType>(0, 1, 1, 0);
+			case 2:
+				return ChannelMatrix<SampleType>(SampleType(0.5),
+						SampleType(0.5), SampleType(0.5), SampleType(0.5));
+			case 3:
+				return ChannelMatrix<SampleType>(1, 0, 1, 0);
+			case 4:
+				return ChannelMatrix<SampleType>(0, 1, 0, 1);
+			default:
+				return ChannelMatrix<SampleType>();
+		}
+	}
+
+	// Sample rate assumed when loading delays saved as sample counts, until
+	// we're told the real one
+	double constexpr legacySampleRate = 48000;
+
+	// How often the message thread checks for latency changes
+	int constexpr latencyPollMs = 50;
+
+	// Longest delay in samples either way, including fine delay
+	int maxDelaySamples(double sampleRate)
+	{
+		return static_cast<int>(std::ceil(SuperSeparator::maxDelayMs
+					* sampleRate / 1000)) + 1;
+	}
+
+	// Whether every channel is digital silence for the whole block. Buses
+	// with no channels, e.g. a disconnected sidechain, count as silent.
+	template<typename SampleType>
+	bool isSilent(SampleType const * const * channels, int numChannels,
+			int numSamples)
+	{
+		for (int j = 0; j < numChannels; ++j)
+		{
+			auto const range = juce::FloatVectorOperations::findMinAndMax(
+					channels[j], numSamples);
+			if (range.getStart() != 0 || range.getEnd() != 0)
+				return false;
+		}
+		return true;
+	}
+
+	// Extend a run of silence by a block, or end it. Saturates rather than
+	// overflowing during long idle periods.
+	void countSilence(int & count, bool silent, int numSamples)
+	{
+		count = silent ? juce::jmin(count, std::numeric_limits<int>::max()
+				- numSamples) + numSamples : 0;
+	}
+
+	// Split a delay into whole samples & a fraction in [0, 1). Delays within
+	// rounding error of a whole number of samples are snapped to it, so ms
+	// values that land on whole samples still get the uninterpolated path.
+	template<typename SampleType>
+	int splitDelay(double samples, SampleType & fraction)
+	{
+		double constexpr epsilon = 1e-6;
+		double const whole = std::floor(samples + epsilon);
+		double const rest = samples - whole;
+		fraction = rest > epsilon ? static_cast<SampleType>(rest) : 0;
+		return static_cast<int>(whole);
+	}
+
+	juce::NormalisableRange<float> delayRange()
+	{
+		return juce::NormalisableRange<float>(-SuperSeparator::maxDelayMs,
+				SuperSeparator::maxDelayMs, 0.001f, 0.5f, true);
+	}
+
+	// Base class for parameters that flag themselves as changed in their
+	// owning SuperSeparator, and pass their values on to followers, when
+	// altered. ValueType is the type passed to the JUCE parameter's
+	// valueChanged callback.
+	template<class ParamType, typename ValueType = int>
+	class NotifyingParam : public ParamType
 	{
 		public:
 			template<typename... Args>
-			ChangeBroadcastedParam(SuperSeparator * proc, Args... args)
+			NotifyingParam(SuperSeparator * proc, Args... args)
 				: ParamType(args...), m_proc(proc)
 			{}
 
 			bool isDiscrete() const override
 			{
-				return true;
+				return std::is_integral<ValueType>::value;
 			}
 
 		protected:
 			SuperSeparator * m_proc;
 
-			void valueChanged(int newValue) override
+			void valueChanged(ValueType newValue) override
 			{
 #ifdef SUPSEP_LOGGING
-				juce::String d{ParamType::getParameterID()};
-				d += " param valueChanged: ";
-				d += newValue;
-				DebugLog::log(m_proc->getLogName(), d);
+				// May be on the audio thread during automation, so don't
+				// build strings here
+				DebugLog::logValue(m_proc->getLogName(),
+						ParamType::getParameterID(),
+						static_cast<juce::int64>(newValue));
+#else
+				juce::ignoreUnused(newValue);
 #endif
-				m_proc->getChangeBroadcaster().sendChangeMessage();
+				m_proc->publishToFollowers();
+				m_proc->markChanged(ParamType::getParameterIndex());
 			}
 	};
 }
@@ -72,15 +273,47 @@ SuperSeparator::SuperSeparator() : juce::AudioProcessor(
 		.withInput("Input", juce::AudioChannelSet::stereo())
 		.withInput("Sidechain", juce::AudioChannelSet::stereo())
 		.withOutput("Output", juce::AudioChannelSet::stereo())),
-	m_floatDelayLine(5760), m_doubleDelayLine(5760),
-	// 5760 = 15 * 384, i.e. enough samples to go up to 15ms delay at
-	// 384kHz. Should be enough for anyone, right...?
-	m_paramDelay(new ChangeBroadcastedParam<juce::AudioParameterInt>
-			(this, "delay", "Delay", 0, 5760, 1, "samples")),
-	m_paramInvert(new ChangeBroadcastedParam<juce::AudioParameterChoice>
+	// Up to maxDelayMs either way. IDs differ from the old sample count
+	// delay parameters, which are converted on loading.
+	m_paramDelay(new NotifyingParam<juce::AudioParameterFloat, float>
+			(this, "delay_ms", "Delay", delayRange(), 0.0f, "ms")),
+	m_paramInvert(new NotifyingParam<juce::AudioParameterChoice>
 			(this, "invert", "Invert",
-			 juce::StringArray{"Secondary", "Primary"}, 0))
+			 juce::StringArray{"Secondary", "Primary"}, 0)),
+	m_paramDelayFraction(
+			new NotifyingParam<juce::AudioParameterFloat, float>
+			(this, "delay_fraction", "Fine delay",
+			 juce::NormalisableRange<float>(0.0f, 1.0f, 0.001f), 0.0f,
+			 "samples")),
+	m_paramBands(new NotifyingParam<juce::AudioParameterInt>
+			(this, "bands", "Bands", 1, Crossover<float>::maxBands, 1)),
+	m_paramCrossoverLow(
+			new NotifyingParam<juce::AudioParameterFloat, float>
+			(this, "crossover_low", "Low crossover",
+			 juce::NormalisableRange<float>(20.0f, 20000.0f, 1.0f, 0.25f),
+			 250.0f, "Hz")),
+	m_paramCrossoverHigh(
+			new NotifyingParam<juce::AudioParameterFloat, float>
+			(this, "crossover_high", "High crossover",
+			 juce::NormalisableRange<float>(20.0f, 20000.0f, 1.0f, 0.25f),
+			 2500.0f, "Hz")),
+	m_paramMode(new NotifyingParam<juce::AudioParameterChoice>
+			(this, "mode", "Mode", juce::StringArray{"Fixed", "Adaptive"},
+			 0)),
+	m_paramAdaptRate(
+			new NotifyingParam<juce::AudioParameterFloat, float>
+			(this, "adapt_rate", "Adaptation rate",
+			 juce::NormalisableRange<float>(0.0f, 1.0f), 0.1f)),
+	m_paramChannels(new NotifyingParam<juce::AudioParameterChoice>
+			(this, "channels", "Channels",
+			 juce::StringArray{"Left/right", "Mid/side"}, 0)),
+	m_paramSideRouting(new NotifyingParam<juce::AudioParameterChoice>
+			(this, "side_routing", "Sidechain routing",
+			 juce::StringArray{"Direct", "Swapped", "Mono", "Left", "Right"},
+			 0))
 {
+	m_legacyDelays.fill(std::numeric_limits<double>::quiet_NaN());
+
 	// TODO: Future parameters?
 	// Per-channel delay gain
 	// Dry/wet (instance-linked)
@@ -92,6 +325,35 @@ SuperSeparator::SuperSeparator() : juce::AudioProcessor(
 	addParameter(m_paramDelay);
 	addParameter(m_paramInvert);
 
+	// Bands above the lowest get their own delay & invert, with the same
+	// ranges as the broadband ones
+	addParameter(m_paramBands);
+	addParameter(m_paramCrossoverLow);
+	addParameter(m_paramCrossoverHigh);
+	for (size_t i = 0; i < m_paramBandDelays.size(); ++i)
+	{
+		juce::String const n(static_cast<int>(i) + 2);
+		m_paramBandDelays[i] =
+			new NotifyingParam<juce::AudioParameterFloat, float>
+			(this, "delay" + n + "_ms", "Band " + n + " delay",
+			 delayRange(), 0.0f, "ms");
+		m_paramBandInverts[i] =
+			new NotifyingParam<juce::AudioParameterChoice>
+			(this, "invert" + n, "Band " + n + " invert",
+			 juce::StringArray{"Secondary", "Primary"}, 0);
+		addParameter(m_paramBandDelays[i]);
+		addParameter(m_paramBandInverts[i]);
+	}
+
+	addParameter(m_paramMode);
+	addParameter(m_paramAdaptRate);
+
+	// Added after the rest so as not to renumber existing parameters for
+	// hosts which identify them by index
+	addParameter(m_paramDelayFraction);
+	addParameter(m_paramChannels);
+	addParameter(m_paramSideRouting);
+
 #ifdef SUPSEP_LOGGING
 	m_logname = juce::String::toHexString(m_uuid.hash());
 	DebugLog::log(m_logname,
@@ -101,10 +363,25 @@ SuperSeparator::SuperSeparator() : juce::AudioProcessor(
 	DebugLog::log(m_logname, oss.str());
 #endif
 
+	juce::String const recordDir = juce::SystemStats::getEnvironmentVariable(
+			"SUPSEP_RECORD", {});
+	if (recordDir.isNotEmpty())
+	{
+		juce::String const name = "supsep-"
+			+ juce::String::toHexString(m_uuid.hash()) + '-'
+			+ juce::Time::getCurrentTime().formatted("%Y%m%d-%H%M%S")
+			+ ".ssrec";
+		m_recordFile = juce::File::getCurrentWorkingDirectory()
+			.getChildFile(recordDir).getChildFile(name);
+	}
+
 	m_remote.reset(new Remote(this));
+	publishToFollowers();
 	bool result =
 		InstanceManager::get()->registerInstance(m_uuid, m_remote.get());
 	jassert(result);
+
+	startTimer(latencyPollMs);
 }
 
 SuperSeparator::~SuperSeparator()
@@ -115,6 +392,7 @@ SuperSeparator::~SuperSeparator()
 #endif
 
 	InstanceManager::get()->unregisterInstance(m_uuid, m_remote.get());
+	stopTimer();
 }
 
 //
@@ -130,19 +408,150 @@ void SuperSeparator::prepareToPlay(double sampleRate,
 			+ juce::String(maximumExpectedSamplesPerBlock));
 #endif
 
-	juce::dsp::ProcessSpec spec {sampleRate,
-		static_cast<uint32_t>(maximumExpectedSamplesPerBlock), 4};
+	m_processMeter.prepare(sampleRate, maximumExpectedSamplesPerBlock);
+	m_sampleRate = sampleRate;
+	applyLegacyDelays();
+
+	if (m_recordFile != juce::File())
+	{
+		int const sampleSize = static_cast<int>(
+				getProcessingPrecision() == singlePrecision
+					? sizeof(float) : sizeof(double));
+		m_recorder.prepare(m_recordFile, sampleRate,
+				maximumExpectedSamplesPerBlock, getTotalNumInputChannels(),
+				sampleSize, isNonRealtime());
+	}
+
+	// Offline renders use heavier processing, spread across spare cores
+	if (isNonRealtime())
+	{
+		m_workers.start(juce::jmin(SeparatorKernel<float>::maxChannels - 1,
+					juce::SystemStats::getNumCpus() - 1));
+	}
+	else
+	{
+		m_workers.stop();
+	}
 
+	// Only the engine for the precision in use holds any storage. Release
+	// the other first, so its blocks can be reused straight away.
 	if (getProcessingPrecision() == singlePrecision)
 	{
-		m_floatDelayLine.setDelay(static_cast<float>(m_paramDelay->get()));
-		m_floatDelayLine.prepare(spec);
+		m_doubleEngine.release();
+		prepareEngine(m_floatEngine, sampleRate,
+				maximumExpectedSamplesPerBlock);
 	}
 	else
 	{
-		m_doubleDelayLine.setDelay(static_cast<float>(m_paramDelay->get()));
-		m_doubleDelayLine.prepare(spec);
+		m_floatEngine.release();
+		prepareEngine(m_doubleEngine, sampleRate,
+				maximumExpectedSamplesPerBlock);
+	}
+
+	// Report latency for the initial settings straight away, rather than
+	// waiting for the first block
+	setLatencySamples(m_latency.load());
+}
+
+template<typename SampleType>
+void SuperSeparator::prepareEngine(Engine<SampleType> & engine,
+		double sampleRate, int maximumExpectedSamplesPerBlock)
+{
+	// Nothing is handed more than a chunk at a time, so working storage
+	// only needs to cover one, however big the host's blocks get
+	int const maxChunk = juce::jlimit(1, chunkSize<SampleType>(),
+			maximumExpectedSamplesPerBlock);
+
+	// Every band's delay line is allocated up front, as the number of
+	// bands may be automated. Delays are read up to the longest delay past
+	// the latency needed for the most negative one.
+	int const maxDelay = 2 * maxDelaySamples(sampleRate);
+	int const fadeLength = static_cast<int>(std::ceil(delayFadeMs
+				* sampleRate / 1000));
+	for (auto & delay : engine.delays)
+		delay.prepare(4, maxDelay, maxChunk, fadeLength);
+
+	engine.crossover.prepare(sampleRate, maxChunk);
+	engine.crossover.setFrequencies(m_paramCrossoverLow->get(),
+			m_paramCrossoverHigh->get());
+	engine.numBands = m_paramBands->get();
+
+	engine.adaptive.prepare(SeparatorKernel<SampleType>::maxChannels,
+			isNonRealtime() ? offlineAdaptiveTaps : adaptiveTaps, maxChunk);
+	engine.wasAdaptive = m_paramMode->getIndex() == 1;
+	engine.mainSilence = engine.sideSilence = 0;
+	engine.sideIdle = engine.idle = false;
+
+	float delayMs = m_paramDelay->get();
+	float fineDelay = m_paramDelayFraction->get();
+	int invert = m_paramInvert->getIndex();
+	m_remote->readLinked(delayMs, fineDelay, invert);
+	setDelays(engine, delayMs, fineDelay, engine.numBands,
+			engine.wasAdaptive);
+}
+
+template<typename SampleType>
+void SuperSeparator::setDelays(Engine<SampleType> & engine, float delayMs,
+		float fineDelay, int numBands, bool adaptive)
+{
+	int constexpr maxBands = Crossover<SampleType>::maxBands;
+	double const samplesPerMs = m_sampleRate / 1000;
+	std::array<int, maxBands> delays;
+	std::array<SampleType, maxBands> fractions;
+	delays[0] = splitDelay(delayMs * samplesPerMs + fineDelay, fractions[0]);
+	for (size_t i = 0; i < m_paramBandDelays.size(); ++i)
+	{
+		delays[i + 1] = splitDelay(m_paramBandDelays[i]->get()
+				* samplesPerMs, fractions[i + 1]);
 	}
+
+	// All bands in use share the latency needed by the most negative
+	// delay, so they stay lined up with each other. Adaptive mode doesn't
+	// use the delay lines, so has none.
+	numBands = juce::jlimit(1, maxBands, numBands);
+	int latency = 0;
+	if (!adaptive)
+	{
+		for (int b = 0; b < numBands; ++b)
+		{
+			latency = juce::jmax(latency, DelayEngine<SampleType>::
+					getMinLatency(delays[static_cast<size_t>(b)]));
+		}
+	}
+
+	// Offline renders can afford a much flatter fractional delay, which
+	// cancels high frequencies more deeply. Switching is crossfaded, in
+	// case a host changes mode without preparing again.
+	int const order = isNonRealtime()
+		? DelayEngine<SampleType>::highOrder
+		: DelayEngine<SampleType>::standardOrder;
+
+	int tail = adaptive ? engine.adaptive.getNumTaps() : 0;
+	for (int b = 0; b < maxBands; ++b)
+	{
+		size_t const i = static_cast<size_t>(b);
+		engine.delays[i].setInterpolationOrder(order);
+		engine.delays[i].setDelay(delays[i], fractions[i], latency);
+		if (!adaptive && b < numBands)
+			tail = juce::jmax(tail, engine.delays[i].getTailLength());
+	}
+	if (!adaptive && numBands > 1)
+		tail += engine.crossover.getTailLength();
+
+	m_tailSamples.store(tail, std::memory_order_relaxed);
+	m_latency.store(latency, std::memory_order_relaxed);
+}
+
+void SuperSeparator::timerCallback()
+{
+	int const latency = m_latency.load(std::memory_order_relaxed);
+	if (latency == getLatencySamples())
+		return;
+
+#ifdef SUPSEP_LOGGING
+	DebugLog::logValue(m_logname, "Latency:", latency);
+#endif
+	setLatencySamples(latency);
 }
 
 void SuperSeparator::releaseResources()
@@ -150,81 +559,295 @@ void SuperSeparator::releaseResources()
 #ifdef SUPSEP_LOGGING
 	DebugLog::log(m_logname, "releaseResources");
 #endif
+
+	// Hand storage back to the pool for other instances to use
+	m_floatEngine.release();
+	m_doubleEngine.release();
+	m_workers.stop();
 }
 
 // As nothing we're doing is specific to float or double type, support both
 // with a single private template method, instantiated inside both the float &
 // double public processing methods.
-template<typename SampleType, typename DelayType>
+template<typename SampleType>
 void SuperSeparator::processBlock(juce::AudioBuffer<SampleType> & buffer,
-		DelayType & delayLine)
+		Engine<SampleType> & engine)
 {
-	// TODO Make sure we code defensively - number of samples in the buffer
-	// might be bigger than maximumExpectedSamplesPerBlock.
-	// Check whether DelayLine handles this natively or just barfs - if the
-	// latter, we will need to chop up blocks here before passing them in.
+	juce::ScopedNoDenormals noDenormals;
 
-	// Apply settings
-	m_floatDelayLine.setDelay(static_cast<float>(m_paramDelay->get()));
+	// Note parameter changes for replay, if recording, before reading them
+	m_recorder.pushParameters(getParameters());
 
-	SampleType mainInputCoeff = 1;
-	SampleType sideInputCoeff = -1;
-	if (m_paramInvert->getIndex() == 1)
-	{
-		mainInputCoeff = -1;
-		sideInputCoeff = 1;
-	}
+	// Apply settings, taking them from the leader instead if we're
+	// following one
+	float delayMs = m_paramDelay->get();
+	float fineDelay = m_paramDelayFraction->get();
+	int invert = m_paramInvert->getIndex();
+	m_remote->readLinked(delayMs, fineDelay, invert);
+
+	int const numBands = m_paramBands->get();
+	bool const adaptive = m_paramMode->getIndex() == 1;
+	setDelays(engine, delayMs, fineDelay, numBands, adaptive);
+
+	std::array<int, Crossover<SampleType>::maxBands> inverts{invert};
+	for (size_t i = 0; i < m_paramBandInverts.size(); ++i)
+		inverts[i + 1] = m_paramBandInverts[i]->getIndex();
 
 	// Grab input & output data pointers
 	auto main = getBusBuffer(buffer, true, 0);
 	auto side = getBusBuffer(buffer, true, 1);
+	int const numMain = main.getNumChannels();
+	int const numSide = side.getNumChannels();
 
 	SampleType const ** pmain = main.getArrayOfReadPointers();
 	SampleType const ** pside = side.getArrayOfReadPointers();
 	SampleType ** dst = main.getArrayOfWritePointers();
 
-	// Main processing
-	for (int i = 0; i < buffer.getNumSamples(); ++i)
+	// Hand unprocessed input to the recorder, delay estimator & analyser,
+	// if they're running
+	m_recorder.pushBlock(pmain, numMain, pside, numSide,
+			buffer.getNumSamples());
+	m_delayEstimator.push(pmain, numMain, pside, numSide,
+			buffer.getNumSamples());
+	m_spectrumAnalyser.push(pmain, numMain, pside, numSide,
+			buffer.getNumSamples());
+
+	// Start from a clean slate whenever switching between fixed & adaptive
+	// modes, rather than carry on from stale state
+	if (adaptive != engine.wasAdaptive)
+	{
+		engine.wasAdaptive = adaptive;
+		if (adaptive)
+		{
+			engine.adaptive.reset();
+		}
+		else
+		{
+			for (auto & delay : engine.delays)
+				delay.reset();
+			engine.crossover.reset();
+		}
+	}
+
+	// Skip work on inputs which have been silent for longer than the tail,
+	// as it can only produce silence. With both inputs idle there is
+	// nothing to do at all: the main input is also the output, and already
+	// silent. With just the sidechain idle, main is processed as if there
+	// were no sidechain. Delay lines aren't written to while idle, so are
+	// cleared on coming back into use, in case of stale history.
+	int const numSamples = buffer.getNumSamples();
+	int const tail = m_tailSamples.load(std::memory_order_relaxed);
+	bool const mainSilent = isSilent(pmain, numMain, numSamples);
+	bool const sideSilent = isSilent(pside, numSide, numSamples);
+	bool const sideIdle = sideSilent && engine.sideSilence >= tail;
+	bool const idle = sideIdle && mainSilent && engine.mainSilence >= tail;
+	countSilence(engine.mainSilence, mainSilent, numSamples);
+	countSilence(engine.sideSilence, sideSilent, numSamples);
+
+	if (idle != engine.idle)
+	{
+#ifdef SUPSEP_LOGGING
+		DebugLog::logValue(m_logname, "Idle:", idle);
+#endif
+		engine.idle = idle;
+		if (!idle)
+		{
+			for (auto & delay : engine.delays)
+				delay.reset();
+			engine.crossover.reset();
+		}
+	}
+	if (idle)
+		return;
+
+	if (sideIdle != engine.sideIdle)
+	{
+		engine.sideIdle = sideIdle;
+		if (!sideIdle)
+		{
+			for (auto & delay : engine.delays)
+			{
+				for (int j = 0; j < SeparatorKernel<SampleType>::maxChannels;
+						++j)
+				{
+					delay.clearChannel(
+							j + SeparatorKernel<SampleType>::maxChannels);
+				}
+			}
+		}
+	}
+	int const numActiveSide = sideIdle ? 0 : numSide;
+
+	// Channel routing, in place, now that the unprocessed input has been
+	// handed on. Mid/side only makes a difference to adaptive mode, where
+	// each channel pair adapts separately; fixed modes treat all channels
+	// alike, so skip the round trip. Routing the sidechain is folded into
+	// the same mix as encoding it.
+	using Matrix = ChannelMatrix<SampleType>;
+	bool const midSide = adaptive && m_paramChannels->getIndex() == 1
+		&& numMain == Matrix::numChannels;
+	auto const routing = sideRouting<SampleType>(
+			m_paramSideRouting->getIndex());
+	if (numActiveSide == Matrix::numChannels)
 	{
-		for (int j = 0; j < main.getNumChannels(); ++j)
+		(midSide ? Matrix::midSideEncode() * routing : routing).apply(
+				side.getArrayOfWritePointers(), numSamples);
+	}
+	if (midSide)
+		Matrix::midSideEncode().apply(dst, numSamples);
+
+	if (adaptive)
+	{
+		processAdaptive(engine, pmain, numMain, pside, numActiveSide, dst,
+				numSamples);
+		if (midSide)
+			Matrix::midSideDecode().apply(dst, numSamples);
+		return;
+	}
+
+	// Main processing. Work through the buffer in cache-sized chunks, which
+	// also copes with hosts handing us more samples than promised in
+	// prepareToPlay, using a kernel specialised for the current invert mode
+	// & channel layout.
+	int maxChunk = juce::jmin(chunkSize<SampleType>(),
+			engine.delays[0].getMaxChunkSize());
+	jassert(maxChunk > 0);
+	if (maxChunk <= 0)
+		return;
+
+	if (numBands <= 1)
+	{
+		// Band 0's delay line only holds the low band's history; start
+		// afresh rather than play that out as full band signal
+		if (engine.numBands > 1)
+			engine.delays[0].reset();
+		engine.numBands = 1;
+		auto kernel = SeparatorKernel<SampleType>::select(invert == 1,
+				numMain, numActiveSide);
+
+		for (int start = 0; start < numSamples; start += maxChunk)
 		{
-			delayLine.pushSample(j, pmain[j][i] * mainInputCoeff);
-			dst[j][i] = delayLine.popSample(j) + pmain[j][i];
+			int const n = juce::jmin(maxChunk, numSamples - start);
+			kernel(engine.delays[0], pmain, pside, dst, start, n);
 		}
+		return;
+	}
+
+	// Multiband: split all inputs into bands, run each band through its own
+	// delay line & kernel in place, and sum the results into the output.
+	// The crossover takes a copy of the input, so it's fine for the output
+	// to overwrite the main input.
+	maxChunk = juce::jmin(maxChunk, engine.crossover.getMaxBlockSize());
+	engine.crossover.setFrequencies(m_paramCrossoverLow->get(),
+			m_paramCrossoverHigh->get());
+
+	int constexpr lanes = Crossover<SampleType>::numLanes;
+	int constexpr half = lanes / 2;
+	jassert(numMain <= half && numSide <= half);
+
+	// Bands coming into use have stale history & filter state; clear it
+	// rather than play out whatever was left from last time, leaving the
+	// filters of bands already playing alone so they don't click
+	if (numBands > engine.numBands)
+	{
+		engine.crossover.resetUnused(engine.numBands);
+		for (int b = engine.numBands; b < numBands; ++b)
+			engine.delays[static_cast<size_t>(b)].reset();
 	}
+	engine.numBands = numBands;
 
-	for (int i = 0; i < buffer.getNumSamples(); ++i)
+	using Kernel = typename SeparatorKernel<SampleType>::Function;
+	std::array<Kernel, Crossover<SampleType>::maxBands> kernels{};
+	for (int b = 0; b < numBands; ++b)
 	{
-		for (int j = 0; j < side.getNumChannels(); ++j)
+		size_t const i = static_cast<size_t>(b);
+		kernels[i] = SeparatorKernel<SampleType>::select(inverts[i] == 1,
+				numMain, numActiveSide);
+	}
+
+	for (int start = 0; start < numSamples; start += maxChunk)
+	{
+		int const n = juce::jmin(maxChunk, numSamples - start);
+
+		SampleType const * in[lanes] = {};
+		for (int j = 0; j < juce::jmin(numMain, half); ++j)
+			in[j] = pmain[j] + start;
+		for (int j = 0; j < juce::jmin(numActiveSide, half); ++j)
+			in[j + half] = pside[j] + start;
+		engine.crossover.split(in, numBands, n);
+
+		for (int b = 0; b < numBands; ++b)
 		{
-			delayLine.pushSample(j + 2, pside[j][i] * sideInputCoeff);
-			dst[j][i] += delayLine.popSample(j + 2) + pside[j][i];
+			size_t const i = static_cast<size_t>(b);
+			SampleType * const * band = engine.crossover.getBand(b);
+			kernels[i](engine.delays[i], band, band + half, band, 0, n);
+
+			for (int j = 0; j < numMain; ++j)
+			{
+				if (b == 0)
+					juce::FloatVectorOperations::copy(dst[j] + start,
+							band[j], n);
+				else
+					juce::FloatVectorOperations::add(dst[j] + start,
+							band[j], n);
+			}
 		}
 	}
 }
 
+template<typename SampleType>
+void SuperSeparator::processAdaptive(Engine<SampleType> & engine,
+		SampleType const * const * main, int numMain,
+		SampleType const * const * side, int numSide,
+		SampleType * const * dst, int numSamples)
+{
+	// Output is the main input, minus whatever of it the adaptive filter
+	// can predict from the sidechain, plus the sidechain itself. Without a
+	// sidechain there is nothing to cancel, and main passes straight
+	// through.
+	SampleType const rate = static_cast<SampleType>(m_paramAdaptRate->get());
+	int const numPairs = juce::jmin(numMain, numSide,
+			SeparatorKernel<SampleType>::maxChannels);
+	jassert(engine.adaptive.getMaxBlockSize() > 0);
+	if (engine.adaptive.getMaxBlockSize() <= 0)
+		return;
+
+	// Channel pairs are independent, so offline they're filtered in
+	// parallel. Live, waiting on another thread isn't safe, so they take
+	// turns.
+	AdaptiveJob<SampleType> job(engine.adaptive, main, side, dst, rate,
+			numSamples);
+	if (numPairs > 1 && m_workers.getNumThreads() > 0 && isNonRealtime())
+	{
+		m_workers.run(job, numPairs);
+	}
+	else
+	{
+		for (int j = 0; j < numPairs; ++j)
+			job.run(j);
+	}
+}
+
 void SuperSeparator::processBlock(juce::AudioBuffer<float> & buffer,
 		juce::MidiBuffer &)
 {
 #ifdef SUPSEP_LOGGING
-	juce::String d("processBlock<float>: ");
-	d += buffer.getNumSamples();
-	d += " samples";
-	DebugLog::log(m_logname, d, false);
+	DebugLog::logValue(m_logname, "processBlock<float> samples:",
+			buffer.getNumSamples(), false);
 #endif
-	processBlock(buffer, m_floatDelayLine);
+	ProcessMeter::ScopedTimer timer(m_processMeter, buffer.getNumSamples());
+	processBlock(buffer, m_floatEngine);
 }
 
 void SuperSeparator::processBlock(juce::AudioBuffer<double> & buffer,
 		juce::MidiBuffer &)
 {
 #ifdef SUPSEP_LOGGING
-	juce::String d("processBlock<double>: ");
-	d += buffer.getNumSamples();
-	d += " samples";
-	DebugLog::log(m_logname, d, false);
+	DebugLog::logValue(m_logname, "processBlock<double> samples:",
+			buffer.getNumSamples(), false);
 #endif
-	processBlock(buffer, m_doubleDelayLine);
+	ProcessMeter::ScopedTimer timer(m_processMeter, buffer.getNumSamples());
+	processBlock(buffer, m_doubleEngine);
 }
 
 //
@@ -233,42 +856,144 @@ void SuperSeparator::processBlock(juce::AudioBuffer<double> & buffer,
 
 void SuperSeparator::getStateInformation(juce::MemoryBlock & destData)
 {
-	// Create an XML document describing the current parameter values,
-	// serialise it to a string, then chuck it in the destination memory block
-	juce::XmlElement settings("settings");
+	// Write a fixed-layout binary record per parameter, so that hosts
+	// restoring hundreds of instances don't have to build & parse XML
+	auto const & params = getParameters();
+	destData.setSize(stateHeaderSize
+			+ static_cast<size_t>(params.size()) * stateRecordSize, true);
 
-	// Settings version. Bump this if non-backwards-compatible changes are
-	// ever made.
-	settings.setAttribute("version", 1);
+	char * p = static_cast<char *>(destData.getData());
+	std::memcpy(p, stateMagic, sizeof(stateMagic));
+	writeStateUint32(p + 4, stateVersion);
+	std::memcpy(p + 12, m_uuid.getRawData(), 16);
+	std::memcpy(p + 28, getLeader().getRawData(), 16);
 
-	// Delay time
-	std::unique_ptr<juce::XmlElement> delay{new juce::XmlElement("delay")};
-	delay->setAttribute("time", m_paramDelay->get());
-	settings.addChildElement(delay.release());
+	uint32_t numRecords = 0;
+	char * record = p + stateHeaderSize;
+	for (auto * param : params)
+	{
+		auto * ranged = dynamic_cast<juce::RangedAudioParameter *>(param);
+		if (ranged == nullptr)
+			continue;
 
-	// Input inversion
-	std::unique_ptr<juce::XmlElement> invert{new juce::XmlElement("invert")};
-	invert->setAttribute("channel", m_paramInvert->getIndex());
-	settings.addChildElement(invert.release());
+		ranged->paramID.copyToUTF8(record, stateIdSize);
+		writeStateDouble(record + stateIdSize,
+				ranged->convertFrom0to1(ranged->getValue()));
+		record += stateRecordSize;
+		++numRecords;
+	}
+	writeStateUint32(p + 8, numRecords);
 
-	// Instance UUID
-	std::unique_ptr<juce::XmlElement> uuid{new juce::XmlElement("uuid")};
-	uuid->setAttribute("uuid", m_uuid.toString());
-	settings.addChildElement(uuid.release());
+#ifdef SUPSEP_LOGGING
+	DebugLog::logValue(m_logname, "getStateInformation: parameters",
+			numRecords);
+#endif
+}
 
-	// Serialise & copy to memory block
-	copyXmlToBinary(settings, destData);
+void SuperSeparator::setStateInformation(void const * data, int size)
+{
+	// Forget any legacy delays still waiting for a sample rate, as this
+	// state replaces them
+	m_legacyDelays.fill(std::numeric_limits<double>::quiet_NaN());
 
+	if (size < 0 || !setBinaryState(static_cast<char const *>(data),
+				static_cast<size_t>(size)))
+		setXmlState(data, size);
+}
+
+bool SuperSeparator::setBinaryState(char const * data, size_t size)
+{
+	if (size < stateV2HeaderSize
+			|| std::memcmp(data, stateMagic, sizeof(stateMagic)) != 0)
+		return false;
+
+	// Check settings version. If unsupported, just leave everything at
+	// default; it's still ours, so don't go trying to parse it as XML.
+	// Version 2 is the same minus the leader UUID.
+	uint32_t const version = readStateUint32(data + 4);
+	size_t const headerSize = version == 2 ? stateV2HeaderSize
+		: stateHeaderSize;
+	if ((version != 2 && version != stateVersion) || size < headerSize)
+	{
 #ifdef SUPSEP_LOGGING
-	DebugLog::log(m_logname, juce::String("getStateInformation:\n---\n")
-			+ settings.toString() + juce::String("---"));
+		DebugLog::logValue(m_logname, "Unsupported settings version:",
+				version);
 #endif
+		return true;
+	}
+
+	uint32_t const numRecords = readStateUint32(data + 8);
+	if (numRecords > (size - headerSize) / stateRecordSize)
+	{
+#ifdef SUPSEP_LOGGING
+		DebugLog::log(m_logname, "Truncated settings; ignoring");
+#endif
+		return true;
+	}
+
+#ifdef SUPSEP_LOGGING
+	DebugLog::logValue(m_logname, "setStateInformation: parameters",
+			numRecords);
+#endif
+
+	// Leave parameters we don't have a record for at their current values,
+	// and skip records for parameters we don't know about
+	auto const & params = getParameters();
+	char const * record = data + headerSize;
+	for (uint32_t i = 0; i < numRecords; ++i, record += stateRecordSize)
+	{
+		char id[stateIdSize + 1];
+		std::memcpy(id, record, stateIdSize);
+		id[stateIdSize] = '\0';
+
+		// Delays used to be saved as sample counts
+		juce::String const legacyId(id);
+		if (legacyId == "delay")
+		{
+			setLegacyDelay(0, readStateDouble(record + stateIdSize));
+			continue;
+		}
+		if (legacyId == "delay2" || legacyId == "delay3")
+		{
+			setLegacyDelay(legacyId == "delay2" ? 1 : 2,
+					readStateDouble(record + stateIdSize));
+			continue;
+		}
+
+		for (auto * param : params)
+		{
+			auto * ranged = dynamic_cast<juce::RangedAudioParameter *>(param);
+			if (ranged != nullptr && ranged->paramID == id)
+			{
+				float v = static_cast<float>(readStateDouble(
+							record + stateIdSize));
+				ranged->setValueNotifyingHost(ranged->convertTo0to1(v));
+				break;
+			}
+		}
+	}
+
+	changeUuid(juce::Uuid(reinterpret_cast<juce::uint8 const *>(data + 12)));
+
+	juce::Uuid leader{juce::Uuid::null()};
+	if (version >= 3)
+		leader = juce::Uuid(reinterpret_cast<juce::uint8 const *>(data + 28));
+	if (leader != getLeader())
+		setLeader(leader);
+	return true;
 }
 
-void SuperSeparator::setStateInformation(void const * data, int size)
+void SuperSeparator::setXmlState(void const * data, int size)
 {
 	// Decode string to XML
 	std::unique_ptr<juce::XmlElement> settings{getXmlFromBinary(data, size)};
+	if (settings == nullptr)
+	{
+#ifdef SUPSEP_LOGGING
+		DebugLog::log(m_logname, "Unrecognised settings format");
+#endif
+		return;
+	}
 
 #ifdef SUPSEP_LOGGING
 	DebugLog::log(m_logname, juce::String("setStateInformation:\n---\n")
@@ -293,8 +1018,8 @@ void SuperSeparator::setStateInformation(void const * data, int size)
 	{
 		if (e->getTagName() == "delay")
 		{
-			int v = e->getIntAttribute("time", m_paramDelay->get());
-			*m_paramDelay = v;
+			if (e->hasAttribute("time"))
+				setLegacyDelay(0, e->getIntAttribute("time"));
 		}
 		else if (e->getTagName() == "invert")
 		{
@@ -304,41 +1029,118 @@ void SuperSeparator::setStateInformation(void const * data, int size)
 		else if (e->getTagName() == "uuid")
 		{
 			juce::String v = e->getStringAttribute("uuid", m_uuid.toString());
-			if (v != m_uuid.toString())
-			{
-				juce::Uuid old{m_uuid};
-				m_uuid = v;
+			changeUuid(juce::Uuid(v));
+		}
+	}
+}
+
+void SuperSeparator::setLegacyDelay(int index, double samples)
+{
+	m_legacyDelays[static_cast<size_t>(index)] = samples;
+	applyLegacyDelays();
+}
+
+void SuperSeparator::applyLegacyDelays()
+{
+	bool const rateKnown = m_sampleRate > 0;
+	double const rate = rateKnown ? m_sampleRate : legacySampleRate;
+	for (size_t i = 0; i < m_legacyDelays.size(); ++i)
+	{
+		double const samples = m_legacyDelays[i];
+		if (std::isnan(samples))
+			continue;
+
+		juce::AudioParameterFloat & param = i == 0
+			? *m_paramDelay : *m_paramBandDelays[i - 1];
+		float const ms = static_cast<float>(samples * 1000 / rate);
+		param.setValueNotifyingHost(param.convertTo0to1(ms));
+		if (!rateKnown)
+			continue;
+
 #ifdef SUPSEP_LOGGING
-				DebugLog::log(m_logname,
-						juce::String("Old UUID: ") + old.toDashedString());
-				m_logname = juce::String::toHexString(m_uuid.hash());
-				DebugLog::log(m_logname,
-						juce::String("New UUID: ") + m_uuid.toDashedString());
+		// Only below minSampleRate can the old range go further than ours
+		if (std::abs(ms) > maxDelayMs)
+		{
+			DebugLog::log(m_logname, juce::String("Warning: legacy delay ")
+					+ juce::String(samples) + " samples is "
+					+ juce::String(ms) + "ms, clamped to "
+					+ juce::String(param.get()) + "ms");
+		}
 #endif
-				InstanceManager::get()->unregisterInstance(old, &(*m_remote));
-				m_remote.reset(new Remote(this));
-				bool result = InstanceManager::get()->registerInstance(m_uuid,
-						&(*m_remote));
-				if (!result)
-				{
-					// Duplicate UUID - possible plugin cut/copy & paste in the
-					// VST host leading to two copies of the same state info.
-					// Keep our original UUID after all.
-					m_uuid =  old;
+		m_legacyDelays[i] = std::numeric_limits<double>::quiet_NaN();
+	}
+}
+
+void SuperSeparator::changeUuid(juce::Uuid const & uuid)
+{
+	if (uuid == m_uuid)
+		return;
+
+	juce::Uuid old{m_uuid};
+	m_uuid = uuid;
 #ifdef SUPSEP_LOGGING
-					m_logname = juce::String::toHexString(m_uuid.hash());
-					DebugLog::log(m_logname,
-							"Registration failed; going back to old UUID");
+	DebugLog::log(m_logname,
+			juce::String("Old UUID: ") + old.toDashedString());
+	m_logname = juce::String::toHexString(m_uuid.hash());
+	DebugLog::log(m_logname,
+			juce::String("New UUID: ") + m_uuid.toDashedString());
 #endif
-					m_remote.reset(new Remote(this));
-					result = InstanceManager::get()->registerInstance(m_uuid,
-						&(*m_remote));
-				}
-			}
-		}
+	// Keep the same Remote, as the audio thread may be reading through it.
+	// Its link to a leader, if any, survives re-registration; followers of
+	// the old UUID lose their link unless it comes back.
+	InstanceManager::get()->unregisterInstance(old, &(*m_remote));
+	bool result = InstanceManager::get()->registerInstance(m_uuid,
+			&(*m_remote));
+	if (!result)
+	{
+		// Duplicate UUID - possible plugin cut/copy & paste in the
+		// VST host leading to two copies of the same state info.
+		// Keep our original UUID after all.
+		m_uuid =  old;
+#ifdef SUPSEP_LOGGING
+		m_logname = juce::String::toHexString(m_uuid.hash());
+		DebugLog::log(m_logname,
+				"Registration failed; going back to old UUID");
+#endif
+		result = InstanceManager::get()->registerInstance(m_uuid,
+			&(*m_remote));
 	}
 }
 
+//
+// Instance linking
+//
+
+bool SuperSeparator::setLeader(juce::Uuid const & leader)
+{
+	if (leader == m_uuid)
+		return false;
+
+	if (!InstanceManager::get()->link(m_uuid, m_remote.get(), leader))
+	{
+#ifdef SUPSEP_LOGGING
+		DebugLog::log(m_logname, juce::String("Refused to follow ")
+				+ leader.toDashedString());
+#endif
+		return false;
+	}
+
+	markChanged(linkChangedBit);
+	return true;
+}
+
+juce::Uuid SuperSeparator::getLeader() const
+{
+	auto l = InstanceManager::get()->lock();
+	return m_remote->getLeaderUuid();
+}
+
+void SuperSeparator::publishToFollowers()
+{
+	m_remote->publish(m_paramDelay->get(), m_paramDelayFraction->get(),
+			m_paramInvert->getIndex());
+}
+
 //
 // GUI
 //
@@ -347,3 +1149,36 @@ juce::AudioProcessorEditor * SuperSeparator::createEditor()
 {
 	return new Editor(this);
 }
+
+bool SuperSeparator::Response::operator==(Response const & other) const
+{
+	return adaptive == other.adaptive && numBands == other.numBands
+		&& crossoverLow == other.crossoverLow
+		&& crossoverHigh == other.crossoverHigh && delays == other.delays
+		&& inverts == other.inverts;
+}
+
+SuperSeparator::Response SuperSeparator::getResponse() const
+{
+	// Same as processBlock, including settings taken from a leader
+	float delayMs = m_paramDelay->get();
+	float fineDelay = m_paramDelayFraction->get();
+	int invert = m_paramInvert->getIndex();
+	m_remote->readLinked(delayMs, fineDelay, invert);
+
+	Response r;
+	r.adaptive = m_paramMode->getIndex() == 1;
+	r.numBands = m_paramBands->get();
+	r.crossoverLow = m_paramCrossoverLow->get();
+	r.crossoverHigh = juce::jmax(r.crossoverLow,
+			static_cast<double>(m_paramCrossoverHigh->get()));
+	r.delays[0] = delayMs / 1000.0
+		+ (m_sampleRate > 0 ? fineDelay / m_sampleRate : 0);
+	r.inverts[0] = invert == 1;
+	for (size_t i = 0; i < m_paramBandDelays.size(); ++i)
+	{
+		r.delays[i + 1] = m_paramBandDelays[i]->get() / 1000.0;
+		r.inverts[i + 1] = m_paramBandInverts[i]->getIndex() == 1;
+	}
+	return r;
+}
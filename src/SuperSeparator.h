@@ -15,10 +15,21 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <memory>
 
 #include <JuceHeader.h>
 
+#include "AdaptiveFilter.h"
+#include "Crossover.h"
+#include "DelayEngine.h"
+#include "DelayEstimator.h"
+#include "ProcessMeter.h"
+#include "Recorder.h"
+#include "SpectrumAnalyser.h"
+#include "Workers.h"
+
 // Forward declaration of plugin editor UI
 class Editor;
 
@@ -27,7 +38,8 @@ class Editor;
 class Remote;
 
 // Main plugin instance "entry point" class & audio processing callbacks
-class SuperSeparator : public juce::AudioProcessor
+class SuperSeparator : public juce::AudioProcessor,
+	private juce::Timer
 {
 	public:
 		SuperSeparator();
@@ -42,9 +54,23 @@ class SuperSeparator : public juce::AudioProcessor
 			return ProjectInfo::projectName;
 		}
 
+		// Delays used to be saved as a count of up to this many samples,
+		// which is longest in ms at the lowest sample rate we support
+		static int constexpr legacyMaxDelaySamples = 5760;
+		static int constexpr minSampleRate = 44100;
+
+		// Longest delay in either direction. Covers the whole legacy range,
+		// so old sessions sound the same when loaded.
+		static float constexpr maxDelayMs = (legacyMaxDelaySamples * 1000
+				+ minSampleRate - 1) / minSampleRate;
+
+		// How long output carries on after input stops, at the current
+		// settings
 		double getTailLengthSeconds() const override
 		{
-			return 0;
+			return m_sampleRate > 0
+				? m_tailSamples.load(std::memory_order_relaxed) / m_sampleRate
+				: 0;
 		}
 
 		bool acceptsMidi() const override
@@ -85,11 +111,16 @@ class SuperSeparator : public juce::AudioProcessor
 
 		juce::AudioProcessorEditor * createEditor() override;
 
-		juce::AudioParameterInt & getParamDelay()
+		juce::AudioParameterFloat & getParamDelay()
 		{
 			return *m_paramDelay;
 		}
 
+		juce::AudioParameterFloat & getParamDelayFraction()
+		{
+			return *m_paramDelayFraction;
+		}
+
 		// TODO Instead of this, expose get/set value methods which abstract
 		// away the toggle between local & remote according to follower mode,
 		// so the Editor doesn't need to care
@@ -98,14 +129,86 @@ class SuperSeparator : public juce::AudioProcessor
 			return *m_paramInvert;
 		}
 
-		// TODO Instead of this, expose get/set value methods which abstract
-		// away the toggle between local & remote according to follower mode,
-		// so the Editor doesn't need to care
-		juce::ChangeBroadcaster & getChangeBroadcaster()
+		// Background estimator driving the editor's auto-align mode
+		DelayEstimator & getDelayEstimator()
+		{
+			return m_delayEstimator;
+		}
+
+		// Background analyser driving the editor's analysis view
+		SpectrumAnalyser & getSpectrumAnalyser()
+		{
+			return m_spectrumAnalyser;
+		}
+
+		// Settings shaping what processing does to the main input, as it
+		// would apply them right now, for the analysis view to draw
+		struct Response
+		{
+			// The filter is learned, so there's no fixed response to draw
+			bool adaptive = false;
+			int numBands = 1;
+			double crossoverLow = 0;
+			double crossoverHigh = 0;
+			// Per band: delay in seconds, and whether it's inverted
+			std::array<double, Crossover<float>::maxBands> delays{};
+			std::array<bool, Crossover<float>::maxBands> inverts{};
+
+			bool operator==(Response const & other) const;
+			bool operator!=(Response const & other) const
+			{
+				return !(*this == other);
+			}
+		};
+
+		// Message thread
+		Response getResponse() const;
+
+		// CPU usage statistics for this instance's processing callback
+		ProcessMeter const & getProcessMeter() const
+		{
+			return m_processMeter;
+		}
+
+		// Change notification for the editor. Parameters set a bit, by
+		// parameter index, whenever they change - possibly on the audio
+		// thread during automation, so this is just an atomic OR - and the
+		// editor collects the lot once per frame. Instance linking changes
+		// set linkChangedBit.
+		static int constexpr linkChangedBit = 31;
+
+		void markChanged(int bit)
+		{
+			jassert(bit >= 0 && bit < 32);
+			m_changed.fetch_or(uint32_t(1) << bit, std::memory_order_release);
+		}
+
+		// Message thread: get & clear the set of changes since last time
+		uint32_t takeChanges()
+		{
+			return m_changed.exchange(0, std::memory_order_acquire);
+		}
+
+		//
+		// Instance linking
+		//
+
+		juce::Uuid const & getUuid() const
 		{
-			return m_changeBroadcaster;
+			return m_uuid;
 		}
 
+		// Message thread: follow another instance's delay & invert settings,
+		// or pass a null UUID to go back to our own. Returns false if the
+		// link isn't allowed (following ourselves, following a follower, or
+		// being followed already).
+		bool setLeader(juce::Uuid const & leader);
+		juce::Uuid getLeader() const;
+
+		// Make current parameter values available to followers. Called
+		// whenever a parameter changes; safe on the audio thread.
+		void publishToFollowers();
+
 		//
 		// Program support
 		//
@@ -156,18 +259,122 @@ class SuperSeparator : public juce::AudioProcessor
 		juce::String m_logname;
 #endif
 
-		juce::dsp::DelayLine<float,
-			juce::dsp::DelayLineInterpolationTypes::Linear> m_floatDelayLine;
-		juce::dsp::DelayLine<double,
-			juce::dsp::DelayLineInterpolationTypes::Linear> m_doubleDelayLine;
-
-		juce::AudioParameterInt * m_paramDelay;
+		// Processing state for one sample type. In broadband mode only the
+		// first delay line is used; in multiband mode, each band has its
+		// own. Delay line channels are the two main inputs followed by the
+		// two sidechain inputs. Adaptive mode uses none of the delay lines,
+		// just the adaptive filter. Storage comes from the BufferPool, and
+		// is only held by the engine for the precision being processed, from
+		// prepareToPlay to releaseResources.
+		template<typename SampleType>
+		struct Engine
+		{
+			std::array<DelayEngine<SampleType>, Crossover<SampleType>::maxBands>
+				delays;
+			Crossover<SampleType> crossover;
+			AdaptiveFilter<SampleType> adaptive;
+			// Bands in use, and whether adaptive, during the previous block
+			int numBands = 1;
+			bool wasAdaptive = false;
+			// Samples of unbroken silence seen on each input bus so far, and
+			// whether processing was skipped for the sidechain alone, or for
+			// everything, during the previous block
+			int mainSilence = 0;
+			int sideSilence = 0;
+			bool sideIdle = false;
+			bool idle = false;
+
+			void release()
+			{
+				for (auto & delay : delays)
+					delay.release();
+				crossover.release();
+				adaptive.release();
+			}
+		};
+
+		Engine<float> m_floatEngine;
+		Engine<double> m_doubleEngine;
+
+		// Delay & invert for the whole signal, or for the lowest band in
+		// multiband mode. The delay is in ms, negative to delay the dry
+		// signal instead, and may be fine tuned by a fraction of a sample.
+		juce::AudioParameterFloat * m_paramDelay;
 		juce::AudioParameterChoice * m_paramInvert;
-
-		juce::ChangeBroadcaster m_changeBroadcaster;
-
-		template<typename SampleType, typename DelayType> void processBlock(
-				juce::AudioBuffer<SampleType> & buffer, DelayType & delayLine);
+		juce::AudioParameterFloat * m_paramDelayFraction;
+
+		// Multiband mode: number of bands (1 for broadband), crossover
+		// frequencies, and delay & invert for the bands above the lowest
+		juce::AudioParameterInt * m_paramBands;
+		juce::AudioParameterFloat * m_paramCrossoverLow;
+		juce::AudioParameterFloat * m_paramCrossoverHigh;
+		std::array<juce::AudioParameterFloat *, 2> m_paramBandDelays;
+		std::array<juce::AudioParameterChoice *, 2> m_paramBandInverts;
+
+		// Fixed delay & polarity, or adaptive cancellation
+		juce::AudioParameterChoice * m_paramMode;
+		juce::AudioParameterFloat * m_paramAdaptRate;
+
+		// Channel routing: left/right or mid/side, and which sidechain
+		// channels feed which main channels
+		juce::AudioParameterChoice * m_paramChannels;
+		juce::AudioParameterChoice * m_paramSideRouting;
+
+		std::atomic<uint32_t> m_changed{0};
+
+		// Negative delays are made by delaying everything else, which the
+		// host needs to know about to compensate. Latency is worked out on
+		// the audio thread, and polled for from the message thread, which
+		// reports it to the host when it changes. Polling means automating
+		// a delay doesn't post a message from the audio thread every block.
+		double m_sampleRate = 0;
+		std::atomic<int> m_latency{0};
+		std::atomic<int> m_tailSamples{0};
+
+		void timerCallback() override;
+
+		DelayEstimator m_delayEstimator;
+		SpectrumAnalyser m_spectrumAnalyser;
+		ProcessMeter m_processMeter;
+
+		// Helper threads for offline rendering, which splits adaptive
+		// filtering across cores. Only running while prepared for
+		// non-realtime processing.
+		Workers m_workers;
+
+		// Capture of input & parameter changes for offline replay, enabled
+		// by pointing the SUPSEP_RECORD environment variable at a directory
+		Recorder m_recorder;
+		juce::File m_recordFile;
+
+		// State loading helpers. setBinaryState returns false if the data
+		// isn't in the binary format at all, in which case it may be
+		// version 1 XML.
+		bool setBinaryState(char const * data, size_t size);
+		void setXmlState(void const * data, int size);
+		void changeUuid(juce::Uuid const & uuid);
+		// Delays saved as sample counts, from before delays were in ms:
+		// the broadband or lowest band's delay, then the higher bands'.
+		// Hosts restore state before prepareToPlay, so they're converted
+		// at an assumed sample rate to begin with, and kept until the real
+		// one is known to convert them again; NaN once done with.
+		std::array<double, Crossover<float>::maxBands> m_legacyDelays;
+		void setLegacyDelay(int index, double samples);
+		void applyLegacyDelays();
+
+		template<typename SampleType> void prepareEngine(
+				Engine<SampleType> & engine, double sampleRate,
+				int maximumExpectedSamplesPerBlock);
+		template<typename SampleType> void setDelays(
+				Engine<SampleType> & engine, float delayMs, float fineDelay,
+				int numBands, bool adaptive);
+		template<typename SampleType> void processBlock(
+				juce::AudioBuffer<SampleType> & buffer,
+				Engine<SampleType> & engine);
+		template<typename SampleType> void processAdaptive(
+				Engine<SampleType> & engine, SampleType const * const * main,
+				int numMain, SampleType const * const * side, int numSide,
+				SampleType * const * dst, int numSamples);
 
 		friend class Remote;
 		std::unique_ptr<Remote> m_remote;
@@ -0,0 +1,96 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "Workers.h"
+
+Workers::~Workers()
+{
+	stop();
+}
+
+void Workers::start(int numThreads)
+{
+	stop();
+	for (int i = 0; i < numThreads; ++i)
+	{
+		m_threads.push_back(std::make_unique<Worker>());
+		m_threads.back()->startThread();
+	}
+}
+
+void Workers::stop()
+{
+	for (auto & thread : m_threads)
+	{
+		thread->signalThreadShouldExit();
+		thread->notify();
+		thread->stopThread(1000);
+	}
+	m_threads.clear();
+}
+
+void Workers::run(Job & job, int numJobs)
+{
+	// Indices are dealt out in turn, the calling thread taking the first
+	// of each round
+	int const numUsed = juce::jmin(getNumThreads(), numJobs - 1);
+	int const stride = numUsed + 1;
+	for (int t = 0; t < numUsed; ++t)
+		m_threads[static_cast<size_t>(t)]->post(job, t + 1, stride, numJobs);
+
+	for (int i = 0; i < numJobs; i += stride)
+		job.run(i);
+
+	for (int t = 0; t < numUsed; ++t)
+		m_threads[static_cast<size_t>(t)]->join();
+}
+
+Workers::Worker::Worker() : juce::Thread("Worker")
+{
+}
+
+void Workers::Worker::post(Job & job, int first, int stride, int end)
+{
+	m_job = &job;
+	m_first = first;
+	m_stride = stride;
+	m_end = end;
+	m_pending.store(true, std::memory_order_release);
+	notify();
+}
+
+void Workers::Worker::join()
+{
+	m_done.wait();
+}
+
+void Workers::Worker::run()
+{
+	// Notifications aren't lost if they arrive before we wait, so no need
+	// to poll
+	while (!threadShouldExit())
+	{
+		wait(-1);
+		if (!m_pending.exchange(false, std::memory_order_acquire))
+			continue;
+
+		{
+			juce::ScopedNoDenormals noDenormals;
+			for (int i = m_first; i < m_end; i += m_stride)
+				m_job->run(i);
+		}
+		m_done.signal();
+	}
+}
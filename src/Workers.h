@@ -0,0 +1,86 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <JuceHeader.h>
+
+// Persistent helper threads for splitting heavy processing across cores,
+// e.g. channels during an offline render. The threads are started ahead of
+// time & sleep between jobs, so handing out work costs a wake-up rather than
+// a thread creation.
+//
+// Running a job blocks the calling thread until every part of it is done,
+// which is fine offline, but not something the real-time audio thread
+// should ever rely on.
+class Workers
+{
+	public:
+		// Work to split up: run() is called once for each index, from any
+		// of the threads
+		struct Job
+		{
+			virtual ~Job() = default;
+			virtual void run(int index) = 0;
+		};
+
+		Workers() = default;
+		~Workers();
+
+		// Start the given number of threads, replacing any already running.
+		// Not real-time safe.
+		void start(int numThreads);
+		void stop();
+
+		int getNumThreads() const
+		{
+			return static_cast<int>(m_threads.size());
+		}
+
+		// Call job.run(i) for each i from 0 to numJobs - 1, sharing them
+		// between the worker threads & the calling thread, and return once
+		// all have finished
+		void run(Job & job, int numJobs);
+
+	private:
+		JUCE_DECLARE_NON_COPYABLE (Workers)
+
+		class Worker : public juce::Thread
+		{
+			public:
+				Worker();
+
+				// Run indices first, first + stride, ... below end, then
+				// signal completion
+				void post(Job & job, int first, int stride, int end);
+				void join();
+
+			private:
+				Job * m_job = nullptr;
+				int m_first = 0;
+				int m_stride = 1;
+				int m_end = 0;
+				std::atomic<bool> m_pending{false};
+				juce::WaitableEvent m_done;
+
+				void run() override;
+		};
+
+		std::vector<std::unique_ptr<Worker>> m_threads;
+};
@@ -0,0 +1,341 @@
+// Copyright 2022 Philip Allison
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program. If not, see <https://www.gnu.org/licenses/>.
+
+// Offline batch renderer. Runs main & sidechain WAV file pairs through a
+// SuperSeparator instance each, exactly as a host would during an offline
+// bounce, and writes the output to a new WAV file. Files are spread across a
+// pool of worker threads, and input is read through memory-mapped readers
+// where possible, so bulk jobs are limited by disk & core count rather than
+// by opening a DAW project per file.
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include <JuceHeader.h>
+
+#include "SharedRegistry.h"
+#include "SuperSeparator.h"
+
+namespace
+{
+	struct Settings
+	{
+		// Applied first, if non-empty, as if restoring a saved session
+		juce::MemoryBlock state;
+		// Then any of these given explicitly on the command line
+		bool hasDelay = false;
+		float delay = 0;
+		int invert = -1;
+		bool doublePrecision = false;
+		int blockSize = 4096;
+	};
+
+	// Open a WAV file for reading, preferring a memory-mapped reader so
+	// samples are converted straight out of the page cache. Falls back to a
+	// normal buffered reader, read in chunks, if the file can't be mapped.
+	std::unique_ptr<juce::AudioFormatReader> openInput(
+			juce::WavAudioFormat & wav, juce::File const & file)
+	{
+		std::unique_ptr<juce::MemoryMappedAudioFormatReader> mapped{
+			wav.createMemoryMappedReader(file)};
+		if (mapped != nullptr && mapped->mapEntireFile())
+			return mapped;
+
+		auto stream = std::make_unique<juce::FileInputStream>(file);
+		if (!stream->openedOk())
+			return nullptr;
+		return std::unique_ptr<juce::AudioFormatReader>(
+				wav.createReaderFor(stream.release(), true));
+	}
+
+	// Renders one main/sidechain pair. Each job has its own plugin instance,
+	// so jobs share nothing but the read-only settings.
+	class RenderJob : public juce::ThreadPoolJob
+	{
+		public:
+			RenderJob(Settings const & settings, juce::File main,
+					juce::File side, juce::File out)
+				: juce::ThreadPoolJob(main.getFileName()),
+				m_settings(settings), m_main(main), m_side(side), m_out(out)
+			{}
+
+			JobStatus runJob() override
+			{
+				if (m_settings.doublePrecision)
+					m_ok = render<double>();
+				else
+					m_ok = render<float>();
+				return jobHasFinished;
+			}
+
+			bool succeeded() const
+			{
+				return m_ok;
+			}
+
+			juce::String const & getError() const
+			{
+				return m_error;
+			}
+
+			juce::File const & getOutput() const
+			{
+				return m_out;
+			}
+
+		private:
+			Settings const & m_settings;
+			juce::File m_main;
+			juce::File m_side;
+			juce::File m_out;
+			bool m_ok = false;
+			juce::String m_error;
+
+			bool fail(juce::String const & msg)
+			{
+				m_error = msg;
+				return false;
+			}
+
+			template<typename SampleType>
+			bool render();
+	};
+
+	template<typename SampleType>
+	bool RenderJob::render()
+	{
+		juce::WavAudioFormat wav;
+		auto mainReader = openInput(wav, m_main);
+		if (mainReader == nullptr)
+			return fail("can't read " + m_main.getFullPathName());
+		auto sideReader = openInput(wav, m_side);
+		if (sideReader == nullptr)
+			return fail("can't read " + m_side.getFullPathName());
+		if (mainReader->sampleRate != sideReader->sampleRate)
+			return fail("sample rates of main & sidechain differ");
+
+		double const sampleRate = mainReader->sampleRate;
+		int const blockSize = m_settings.blockSize;
+
+		// Set up the processor as a host would for an offline bounce
+		auto proc = std::make_unique<SuperSeparator>();
+		if (m_settings.state.getSize() > 0)
+		{
+			proc->setStateInformation(m_settings.state.getData(),
+					static_cast<int>(m_settings.state.getSize()));
+		}
+		if (m_settings.hasDelay)
+			proc->getParamDelay() = m_settings.delay;
+		if (m_settings.invert >= 0)
+			proc->getParamInvert() = m_settings.invert;
+
+		proc->setNonRealtime(true);
+		proc->setProcessingPrecision(m_settings.doublePrecision
+				? juce::AudioProcessor::doublePrecision
+				: juce::AudioProcessor::singlePrecision);
+		proc->prepareToPlay(sampleRate, blockSize);
+
+		// Keep going past the end of the input until the delayed signal has
+		// been flushed out too. Drop the plugin's latency from the start of
+		// the output, as a host would, so it stays in time with the input.
+		juce::int64 const inputLength = juce::jmax(
+				mainReader->lengthInSamples, sideReader->lengthInSamples);
+		juce::int64 const processLength = inputLength + juce::roundToInt(
+				proc->getTailLengthSeconds() * sampleRate);
+		int const latency = proc->getLatencySamples();
+
+		std::unique_ptr<juce::FileOutputStream> stream{
+			new juce::FileOutputStream(m_out)};
+		if (!stream->openedOk())
+			return fail("can't write " + m_out.getFullPathName());
+		stream->setPosition(0);
+		stream->truncate();
+
+		int const bits = juce::jlimit(16, 32,
+				static_cast<int>(mainReader->bitsPerSample));
+		std::unique_ptr<juce::AudioFormatWriter> writer{wav.createWriterFor(
+				stream.get(), sampleRate, 2, bits, {}, 0)};
+		if (writer == nullptr)
+			return fail("can't create WAV writer");
+		stream.release();
+
+		// Readers & writers deal in float. Readers take care of converting
+		// from the file's sample format, feeding mono files to both
+		// channels, and zero-filling past the end of the file.
+		juce::AudioBuffer<float> mainIo(2, blockSize);
+		juce::AudioBuffer<float> sideIo(2, blockSize);
+		juce::AudioBuffer<SampleType> buffer(4, blockSize);
+		juce::MidiBuffer midi;
+
+		// Channels are main L/R then sidechain L/R, matching the
+		// processor's bus layout
+		float * io[] = {
+			mainIo.getWritePointer(0), mainIo.getWritePointer(1),
+			sideIo.getWritePointer(0), sideIo.getWritePointer(1)
+		};
+
+		for (juce::int64 pos = 0; pos < processLength; pos += blockSize)
+		{
+			int const n = static_cast<int>(juce::jmin<juce::int64>(
+						blockSize, processLength - pos));
+			mainReader->read(&mainIo, 0, n, pos, true, true);
+			sideReader->read(&sideIo, 0, n, pos, true, true);
+
+			if constexpr (std::is_same<SampleType, float>::value)
+			{
+				juce::AudioBuffer<float> block(io, 4, n);
+				proc->processBlock(block, midi);
+			}
+			else
+			{
+				for (int c = 0; c < 4; ++c)
+					std::copy(io[c], io[c] + n, buffer.getWritePointer(c));
+				juce::AudioBuffer<SampleType> block(
+						buffer.getArrayOfWritePointers(), 4, n);
+				proc->processBlock(block, midi);
+				for (int c = 0; c < 2; ++c)
+				{
+					SampleType const * p = buffer.getReadPointer(c);
+					std::transform(p, p + n, io[c], [](SampleType v)
+							{ return static_cast<float>(v); });
+				}
+			}
+
+			int const skip = static_cast<int>(juce::jlimit<juce::int64>(0, n,
+						latency - pos));
+			if (skip < n && !writer->writeFromAudioSampleBuffer(mainIo,
+						skip, n - skip))
+				return fail("write failed for " + m_out.getFullPathName());
+		}
+
+		proc->releaseResources();
+		return true;
+	}
+
+	void usage()
+	{
+		std::printf("Usage: supsep-render [options] MAIN SIDE OUT"
+				" [MAIN SIDE OUT ...]\n"
+				"  --state FILE  apply a saved plugin state first\n"
+				"  --delay MS    delay in ms, negative to delay the dry"
+				" signal\n"
+				"  --invert N    0 to invert secondary, 1 for primary\n"
+				"  --double      process in double precision\n"
+				"  --block N     samples per processing block"
+				" (default 4096)\n"
+				"  --jobs N      worker threads (default: one per core)\n");
+	}
+}
+
+int main(int argc, char * argv[])
+{
+	// Instance registration & latency reporting run on the message thread,
+	// so we need a message manager to exist
+	juce::ScopedJuceInitialiser_GUI juceInit;
+
+	// Our instances are nothing to do with any DAW session, so shouldn't
+	// be offered for linking there, or use up shared registry slots
+	SharedRegistry::get()->disable();
+
+	Settings settings;
+	int numJobs = juce::SystemStats::getNumCpus();
+	std::vector<juce::File> files;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		juce::String arg(argv[i]);
+		bool const hasValue = i + 1 < argc;
+		if (arg == "--state" && hasValue)
+		{
+			juce::File state(juce::File::getCurrentWorkingDirectory()
+					.getChildFile(argv[++i]));
+			if (!state.loadFileAsData(settings.state))
+			{
+				std::fprintf(stderr, "Can't read state file %s\n",
+						state.getFullPathName().toRawUTF8());
+				return 1;
+			}
+		}
+		else if (arg == "--delay" && hasValue)
+		{
+			settings.hasDelay = true;
+			settings.delay = juce::String(argv[++i]).getFloatValue();
+		}
+		else if (arg == "--invert" && hasValue)
+		{
+			settings.invert = juce::String(argv[++i]).getIntValue();
+		}
+		else if (arg == "--double")
+		{
+			settings.doublePrecision = true;
+		}
+		else if (arg == "--block" && hasValue)
+		{
+			settings.blockSize = juce::String(argv[++i]).getIntValue();
+		}
+		else if (arg == "--jobs" && hasValue)
+		{
+			numJobs = juce::String(argv[++i]).getIntValue();
+		}
+		else if (arg.startsWith("--"))
+		{
+			usage();
+			return arg == "--help" ? 0 : 1;
+		}
+		else
+		{
+			files.push_back(juce::File::getCurrentWorkingDirectory()
+					.getChildFile(arg));
+		}
+	}
+
+	if (files.empty() || files.size() % 3 != 0 || settings.blockSize <= 0
+			|| numJobs <= 0 || settings.invert > 1)
+	{
+		usage();
+		return 1;
+	}
+
+	juce::ThreadPool pool(numJobs);
+	std::vector<std::unique_ptr<RenderJob>> jobs;
+	for (size_t i = 0; i < files.size(); i += 3)
+	{
+		jobs.emplace_back(new RenderJob(settings, files[i], files[i + 1],
+					files[i + 2]));
+		pool.addJob(jobs.back().get(), false);
+	}
+
+	int failures = 0;
+	for (auto & job : jobs)
+	{
+		pool.waitForJobToFinish(job.get(), -1);
+		if (job->succeeded())
+		{
+			std::printf("%s\n", job->getOutput().getFullPathName()
+					.toRawUTF8());
+		}
+		else
+		{
+			std::fprintf(stderr, "%s: %s\n", job->getJobName().toRawUTF8(),
+					job->getError().toRawUTF8());
+			++failures;
+		}
+	}
+
+	return failures == 0 ? 0 : 1;
+}